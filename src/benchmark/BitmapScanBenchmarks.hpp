@@ -0,0 +1,93 @@
+#include <phallocators/math/BitScan.hpp>
+#include <Config.hpp>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "Clock.hpp"
+
+#define SCAN_ITERATIONS 100
+
+/**
+ * Kernels being compared
+ */
+struct BitScanKernel_Simd
+{
+    static uint64_t Scan(const uint8_t* data, uint64_t size, uint8_t value)
+    {
+        return FindFirstNotEqual(data, 0, size, value);
+    }
+};
+
+struct BitScanKernel_Scalar
+{
+    static uint64_t Scan(const uint8_t* data, uint64_t size, uint8_t value)
+    {
+        return FindFirstNotEqualScalar(data, 0, size, value);
+    }
+};
+
+// The loop the bitmap allocator used before, 1 bitmap unit at a time
+struct BitScanKernel_UnitLoop
+{
+    static uint64_t Scan(const uint8_t* data, uint64_t size, uint8_t value)
+    {
+        auto* units = reinterpret_cast<const uint32_t*>(data);
+        uint32_t pattern = 0x01010101u * value;
+
+        uint64_t i = 0;
+        while (i < size / sizeof(uint32_t) && units[i] == pattern)
+            i++;
+
+        return i * sizeof(uint32_t);
+    }
+};
+
+/**
+ * Scans a bitmap of MEM_SIZE / BLOCK_SIZE bits, where the first 'usedPercent'
+ * percent of the blocks are used, and the rest are randomly used/free.
+ */
+template<typename TKernel>
+class BitmapScanBenchmark
+{
+public:
+    BitmapScanBenchmark(int seed, int usedPercent)
+        : m_Seed(seed),
+          m_UsedPercent(usedPercent),
+          m_Bitmap(MEM_SIZE / BLOCK_SIZE / 8)
+    {
+    }
+
+    void Setup()
+    {
+        std::mt19937 generator(m_Seed);
+        std::uniform_int_distribution<int> randByte(0, 0xFE);
+
+        size_t used = m_Bitmap.size() * m_UsedPercent / 100;
+        for (size_t i = 0; i < m_Bitmap.size(); i++)
+            m_Bitmap[i] = (i < used) ? 0xFF : static_cast<uint8_t>(randByte(generator));
+    }
+
+    double Run()
+    {
+        Clock clock;
+        uint64_t total = 0;
+
+        for (int i = 0; i < SCAN_ITERATIONS; i++)
+        {
+            clock.Start();
+            total += TKernel::Scan(m_Bitmap.data(), m_Bitmap.size(), 0xFF);
+            clock.Stop();
+        }
+
+        // make sure the scans are not optimized away
+        if (total == 0)
+            m_Bitmap[0] = 0;
+
+        return clock.ElapsedSeconds();
+    }
+
+private:
+    int m_Seed;
+    int m_UsedPercent;
+    std::vector<uint8_t> m_Bitmap;
+};
@@ -2,16 +2,25 @@
 
 #include <phallocators/allocators/BitmapAllocator.hpp>
 #include <phallocators/allocators/BuddyAllocator.hpp>
+#include <phallocators/allocators/BuddyTreeAllocator.hpp>
 #include <phallocators/allocators/LinkedListAllocator.hpp>
+#include <phallocators/allocators/TLSFAllocator.hpp>
+#include <phallocators/allocators/CompactLinkedListAllocator.hpp>
+#include <phallocators/allocators/ConcurrentBitmapAllocator.hpp>
+#include <phallocators/allocators/PerCpuCache.hpp>
+#include <phallocators/allocators/ShardedAllocator.hpp>
+#include <phallocators/allocators/FlatCombining.hpp>
 #include <phallocators/allocators/experiments/BSTAllocator.hpp>
 #include <phallocators/allocators/experiments/BBSTAllocator.hpp>
 #include <phallocators/allocators/experiments/DualBBSTAllocator.hpp>
 #include "SpeedBenchmarks.hpp"
 #include "FragmentationAndWasteBenchmark.hpp"
+#include "BitmapScanBenchmarks.hpp"
 #include <algorithm>
 #include <iomanip>
 #include <thread>
 #include <future>
+#include <mutex>
 
 #define ITERATIONS 240
 
@@ -83,13 +92,131 @@ void SpeedBenchmarks()
     DoSpeedBenchmarks<BitmapAllocatorBestFit>();
     DoSpeedBenchmarks<BitmapAllocatorWorstFit>();
     DoSpeedBenchmarks<BuddyAllocator>();
+    DoSpeedBenchmarks<BuddyAllocatorFreeList>();
+    DoSpeedBenchmarks<BuddyAllocator64K>();
+    DoSpeedBenchmarks<BuddyAllocator1G>();
+    DoSpeedBenchmarks<BuddyAllocatorExact>();
+    DoSpeedBenchmarks<BuddyAllocatorFreeListExact>();
+    DoSpeedBenchmarks<BuddyTreeAllocator>();
     DoSpeedBenchmarks<LinkedListAllocatorFirstFit>();
     DoSpeedBenchmarks<LinkedListAllocatorNextFit>();
     DoSpeedBenchmarks<LinkedListAllocatorBestFit>();
     DoSpeedBenchmarks<LinkedListAllocatorWorstFit>();
+    DoSpeedBenchmarks<TLSFAllocator>();
+    DoSpeedBenchmarks<CompactLinkedListAllocatorFirstFit>();
+    DoSpeedBenchmarks<CompactLinkedListAllocatorBestFit>();
     DoSpeedBenchmarks<BSTAllocator>();
     DoSpeedBenchmarks<BBSTAllocator>();
     DoSpeedBenchmarks<DualBBSTAllocator>();
+    DoSpeedBenchmarks<ConcurrentBitmapAllocator>();
+}
+
+// Refills the node pools in Maintain() instead of during Allocate
+template <typename TAllocator, uint64_t TLow, uint64_t THigh>
+class PoolWatermarks : public TAllocator
+{
+public:
+    PoolWatermarks()
+    {
+        this->SetPoolWatermarks(TLow, THigh);
+    }
+};
+
+template <typename TAllocator>
+void DoPoolRefillBenchmark()
+{
+    DoSpeedBenchmark<AllocatorBenchmark_AllocWorstCase<TAllocator>>();
+    DoSpeedBenchmark<AllocatorBenchmark_AllocWorstCase<PoolWatermarks<TAllocator, 32, 128>>>();
+}
+
+void PoolRefillBenchmarks()
+{
+    DoPoolRefillBenchmark<LinkedListAllocatorFirstFit>();
+    DoPoolRefillBenchmark<TLSFAllocator>();
+    DoPoolRefillBenchmark<BSTAllocator>();
+}
+
+// Makes any allocator thread safe with a single lock, as a baseline for the concurrent allocators
+template <typename TAllocator>
+class Locked : public TAllocator
+{
+public:
+    ptr_t Allocate(uint32_t blocks = 1) override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        return TAllocator::Allocate(blocks);
+    }
+
+    void Free(ptr_t base, uint32_t blocks) override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        TAllocator::Free(base, blocks);
+    }
+
+private:
+    std::mutex m_Lock;
+};
+
+template <typename TAllocator>
+void DoConcurrentBenchmarks()
+{
+    for (int threads = 1; threads <= THREADS; threads *= 2)
+        DoSpeedBenchmark<AllocatorBenchmark_Concurrent<TAllocator>>(threads);
+}
+
+void ConcurrentBenchmarks()
+{
+    DoConcurrentBenchmarks<Locked<BitmapAllocatorFirstFit>>();
+    DoConcurrentBenchmarks<Locked<BuddyAllocator>>();
+    DoConcurrentBenchmarks<Locked<LinkedListAllocatorFirstFit>>();
+    DoConcurrentBenchmarks<Locked<BSTAllocator>>();
+    DoConcurrentBenchmarks<Locked<DualBBSTAllocator>>();
+    DoConcurrentBenchmarks<ConcurrentBitmapAllocator>();
+    DoConcurrentBenchmarks<PerCpuCache<BitmapAllocatorFirstFit>>();
+    DoConcurrentBenchmarks<PerCpuCache<BuddyAllocator>>();
+    DoConcurrentBenchmarks<PerCpuCache<LinkedListAllocatorFirstFit>>();
+    DoConcurrentBenchmarks<ShardedAllocator<BitmapAllocatorFirstFit, 8, ShardPolicy::Contiguous>>();
+    DoConcurrentBenchmarks<ShardedAllocator<BitmapAllocatorFirstFit, 8, ShardPolicy::Interleaved>>();
+    DoConcurrentBenchmarks<ShardedAllocator<LinkedListAllocatorFirstFit, 8, ShardPolicy::Contiguous>>();
+    DoConcurrentBenchmarks<ShardedAllocator<LinkedListAllocatorFirstFit, 8, ShardPolicy::Interleaved>>();
+    DoConcurrentBenchmarks<FlatCombining<LinkedListAllocatorFirstFit>>();
+    DoConcurrentBenchmarks<FlatCombining<BSTAllocator>>();
+    DoConcurrentBenchmarks<FlatCombining<DualBBSTAllocator>>();
+}
+
+template <template<typename> class TAllocator>
+void DoBitmapUnitBenchmarks()
+{
+    DoSpeedBenchmarks<TAllocator<uint8_t>>();
+    DoSpeedBenchmarks<TAllocator<uint16_t>>();
+    DoSpeedBenchmarks<TAllocator<uint32_t>>();
+    DoSpeedBenchmarks<TAllocator<uint64_t>>();
+}
+
+void BitmapUnitBenchmarks()
+{
+    DoBitmapUnitBenchmarks<BasicBitmapAllocatorFirstFit>();
+    DoBitmapUnitBenchmarks<BasicBitmapAllocatorNextFit>();
+    DoBitmapUnitBenchmarks<BasicBitmapAllocatorBestFit>();
+    DoBitmapUnitBenchmarks<BasicBitmapAllocatorWorstFit>();
+}
+
+template <typename TKernel>
+void DoBitmapScanBenchmarks()
+{
+    DoSpeedBenchmark<BitmapScanBenchmark<TKernel>>(25);
+    DoSpeedBenchmark<BitmapScanBenchmark<TKernel>>(50);
+    DoSpeedBenchmark<BitmapScanBenchmark<TKernel>>(75);
+    DoSpeedBenchmark<BitmapScanBenchmark<TKernel>>(100);
+}
+
+void BitmapScanBenchmarks()
+{
+    std::cerr << "Bitmap scan kernel: " << BitScanKernelName() << std::endl;
+
+    DoBitmapScanBenchmarks<BitScanKernel_Simd>();
+    DoBitmapScanBenchmarks<BitScanKernel_Scalar>();
+    DoBitmapScanBenchmarks<BitScanKernel_UnitLoop>();
 }
 
 
@@ -177,17 +304,31 @@ void FragmentationAndWasteBenchmarks()
     DoFragmentationAndWasteBenchmark<BitmapAllocatorBestFit>();
     DoFragmentationAndWasteBenchmark<BitmapAllocatorWorstFit>();
     DoFragmentationAndWasteBenchmark<BuddyAllocator>();
+    DoFragmentationAndWasteBenchmark<BuddyAllocatorFreeList>();
+    DoFragmentationAndWasteBenchmark<BuddyAllocator64K>();
+    DoFragmentationAndWasteBenchmark<BuddyAllocator1G>();
+    DoFragmentationAndWasteBenchmark<BuddyAllocatorExact>();
+    DoFragmentationAndWasteBenchmark<BuddyAllocatorFreeListExact>();
+    DoFragmentationAndWasteBenchmark<BuddyTreeAllocator>();
     DoFragmentationAndWasteBenchmark<LinkedListAllocatorFirstFit>();
     DoFragmentationAndWasteBenchmark<LinkedListAllocatorNextFit>();
     DoFragmentationAndWasteBenchmark<LinkedListAllocatorBestFit>();
     DoFragmentationAndWasteBenchmark<LinkedListAllocatorWorstFit>();
+    DoFragmentationAndWasteBenchmark<TLSFAllocator>();
+    DoFragmentationAndWasteBenchmark<CompactLinkedListAllocatorFirstFit>();
+    DoFragmentationAndWasteBenchmark<CompactLinkedListAllocatorBestFit>();
     DoFragmentationAndWasteBenchmark<BSTAllocator>();
     DoFragmentationAndWasteBenchmark<BBSTAllocator>();
     DoFragmentationAndWasteBenchmark<DualBBSTAllocator>();
+    DoFragmentationAndWasteBenchmark<ConcurrentBitmapAllocator>();
 }
 
 int main()
 {
     //SpeedBenchmarks();
+    //BitmapScanBenchmarks();
+    //BitmapUnitBenchmarks();
+    //PoolRefillBenchmarks();
+    //ConcurrentBenchmarks();
     FragmentationAndWasteBenchmarks();
 }
@@ -5,12 +5,18 @@
 #include <random>
 #include <iostream>
 #include <cassert>
+#include <memory.h>
 #include <memory>
+#include <vector>
+#include <thread>
+#include <chrono>
 #include "Clock.hpp"
 
 #define MAX_USED_REGIONS 5000
 #define INIT_ITERATIONS 500
 #define TEST_ITERATIONS 100
+#define WORST_CASE_ITERATIONS 1000
+#define CONCURRENT_ITERATIONS 10000
 
 template<typename TAllocator>
 class AllocatorBenchmark
@@ -282,3 +288,153 @@ private:
         }
     }
 };
+
+
+
+/**
+ * Measures the slowest single allocation instead of the total time. Maintain() is
+ * called between allocations, outside of the measured time.
+ */
+template<typename TAllocator>
+class AllocatorBenchmark_AllocWorstCase : public AllocatorBenchmark<TAllocator>
+{
+typedef AllocatorBenchmark<TAllocator> Base;
+
+public:
+    AllocatorBenchmark_AllocWorstCase(int seed)
+        : Base(seed)
+    {
+        // all the runs share memory which was touched once, so page faults don't show up
+        // as allocator latency
+        this->m_BasePtr.reset(Arena());
+    }
+
+    ~AllocatorBenchmark_AllocWorstCase()
+    {
+        this->m_BasePtr.release();
+    }
+
+    double Run() override
+    {
+        double worst = 0;
+
+        for (int i = 0; i < WORST_CASE_ITERATIONS && this->m_FreeBlocks > 0; i++)
+        {
+            this->m_Allocator->Maintain();
+
+            Clock clock;
+            size_t size = this->RandomSize();
+            ptr_t base;
+
+            {
+                clock.Start();
+                base = this->m_Allocator->Allocate(size);
+                clock.Stop();
+            }
+
+            if (base != nullptr)
+            {
+                Region r = { base, size, RegionType::Reserved };
+                this->m_AllocatedRegions.push_back(r);
+                this->m_FreeBlocks -= size;
+            }
+
+            if (clock.ElapsedSeconds() > worst)
+                worst = clock.ElapsedSeconds();
+        }
+
+        return worst;
+    }
+
+private:
+    static uint8_t* Arena()
+    {
+        static uint8_t* arena = nullptr;
+        if (arena == nullptr)
+        {
+            arena = new uint8_t[MEM_SIZE];
+            memset(arena, 0, MEM_SIZE);
+        }
+        return arena;
+    }
+};
+
+
+
+/**
+ * Runs an allocate/free mix on several threads at the same time, every thread with its own
+ * regions. Measures wall time instead of CPU time, and every thread does the same amount
+ * of work, so the time stays the same as threads are added if the allocator scales.
+ */
+template<typename TAllocator>
+class AllocatorBenchmark_Concurrent : public AllocatorBenchmark<TAllocator>
+{
+typedef AllocatorBenchmark<TAllocator> Base;
+
+public:
+    AllocatorBenchmark_Concurrent(int seed, int threads)
+        : Base(seed),
+          m_Threads(threads)
+    {
+    }
+
+    double Run() override
+    {
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+
+        for (int t = 0; t < m_Threads; t++)
+            threads.emplace_back([this, t]() { RunThread(this->m_Seed * m_Threads + t); });
+
+        for (auto& thread : threads)
+            thread.join();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+private:
+    void RunThread(int seed)
+    {
+        std::mt19937 generator(seed);
+        std::uniform_int_distribution<int> randPercent(0, 100);
+        std::geometric_distribution<size_t> randSize(0.05);
+        std::vector<Region> regions;
+
+        for (int i = 0; i < CONCURRENT_ITERATIONS; i++)
+        {
+            bool alloc = regions.empty() 
+                || (regions.size() < static_cast<size_t>(MAX_USED_REGIONS / m_Threads) && randPercent(generator) < 50);
+
+            if (alloc)
+            {
+                size_t size = 1;
+                if (randPercent(generator) >= BLOCK_SIZE_1_RATIO)
+                {
+                    do {
+                        size = randSize(generator);
+                    } while (size == 0);
+                }
+
+                ptr_t base = this->m_Allocator->Allocate(size);
+                if (base != nullptr)
+                    regions.push_back({ base, size, RegionType::Reserved });
+            }
+            else
+            {
+                std::uniform_int_distribution<size_t> randRegion(0, regions.size() - 1);
+                size_t reg = randRegion(generator);
+
+                this->m_Allocator->Free(regions[reg].Base, regions[reg].Size);
+                regions[reg] = regions.back();
+                regions.pop_back();
+            }
+        }
+
+        // leave the memory as the next iteration expects it
+        for (auto& region : regions)
+            this->m_Allocator->Free(region.Base, region.Size);
+    }
+
+    int m_Threads;
+};
\ No newline at end of file
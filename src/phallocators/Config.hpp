@@ -17,3 +17,16 @@
 
 #define DEBUG_LEVEL             DEBUG_LEVEL_INFO
 
+// Bitmap allocator: keep a 2 level summary of the bitmap (1 bit for every bitmap unit that
+// still has free blocks, and 1 bit for every summary word that is not empty), so searching
+// can skip over fully used regions instead of scanning the whole bitmap
+#define BITMAP_SUMMARY          1
+
+// Buddy allocator: keep a tree with the longest run of free top level blocks in every
+// subtree, so allocations bigger than the top level can find a run in O(log n)
+#define BUDDY_RUN_INDEX         1
+
+// Linked list allocator: support a radix tree index of the regions by address, so Free and
+// GetState can find a region without walking the list. Allocators turn it on with
+// SetAddressIndex (TLSF does by default)
+#define LINKED_LIST_ADDRESS_INDEX 1
@@ -42,6 +42,9 @@ public:
     bool Initialize(uint64_t blockSize, const Region regions[], size_t regionCount);
     virtual ptr_t Allocate(uint32_t blocks = 1) = 0;
     virtual void Free(ptr_t base, uint32_t blocks) = 0;
+
+    // Does deferred bookkeeping work; call it at a safe point, outside of Allocate and Free
+    virtual void Maintain() { }
     
     // for statistics
     virtual RegionType GetState(ptr_t address) = 0;
@@ -1,35 +1,60 @@
 #include "BitmapAllocator.hpp"
 #include <math/MathHelpers.hpp>
+#include <math/BitScan.hpp>
 #include <util/JsonWriter.hpp>
 #include <Debug.hpp>
 #include <memory.h>
 #include <sstream>
+#include <algorithm>
 
 #define INVALID_BLOCK                   ((uint64_t)-1)
+#define NO_LIMIT                        ((uint64_t)-1)
 
-BitmapAllocator::BitmapAllocator()
+template<typename TUnit>
+BasicBitmapAllocator<TUnit>::BasicBitmapAllocator()
     : Allocator(),
       m_Bitmap(nullptr),
-      m_BitmapSize(0)
+      m_BitmapSize(0),
+      m_UnitCount(0),
+#if BITMAP_SUMMARY
+      m_Summary(nullptr),
+      m_SummaryTop(nullptr),
+      m_SummaryUnitCount(0),
+      m_SummaryTopUnitCount(0),
+#endif
+      m_SummarySize(0)
 {
 }
 
-bool BitmapAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
+template<typename TUnit>
+bool BasicBitmapAllocator<TUnit>::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 {
-    m_BitmapSize = DivRoundUp(m_MemSize, 8ul);
+    m_UnitCount = DivRoundUp(m_MemSize, static_cast<uint64_t>(BlocksPerUnit));
+    m_BitmapSize = m_UnitCount * sizeof(BitmapUnitType);
+
+#if BITMAP_SUMMARY
+    // summary is placed right after the bitmap
+    uint64_t summaryOffset = DivRoundUp(m_BitmapSize, sizeof(SummaryUnitType)) * sizeof(SummaryUnitType);
+    m_SummaryUnitCount = DivRoundUp(m_UnitCount, static_cast<uint64_t>(BitsPerSummaryUnit));
+    m_SummaryTopUnitCount = DivRoundUp(m_SummaryUnitCount, static_cast<uint64_t>(BitsPerSummaryUnit));
+    m_SummarySize = summaryOffset - m_BitmapSize
+                  + (m_SummaryUnitCount + m_SummaryTopUnitCount) * sizeof(SummaryUnitType);
+#endif
+
+    uint64_t totalSize = m_BitmapSize + m_SummarySize;
 
     // Find free region to fit BitmapSize
     RegionBlocks *freeRegion = nullptr;
     for (size_t i = 0; i < regionCount; i++)
     {
-        if (regions[i].Type == RegionType::Free && regions[i].Size * m_BlockSize >= m_BitmapSize)
+        if (regions[i].Type == RegionType::Free && regions[i].Size * m_BlockSize >= totalSize)
             freeRegion = &regions[i];
     }
 
     // no free space :(
     if (freeRegion == nullptr)
     {
-        Debug::Error("BitmapAllocator", "Not enough free memory - needed %u!", m_BitmapSize);
+        Debug::Error("BitmapAllocator", "Not enough free memory - needed %u!", totalSize);
         return false;
     }
 
@@ -37,7 +62,14 @@ bool BitmapAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 
     // initialize bitmap with everything marked as "used"
     memset(m_Bitmap, 0xFF, m_BitmapSize);
-    
+
+#if BITMAP_SUMMARY
+    // nothing is free yet, so the summary is empty
+    m_Summary = reinterpret_cast<SummaryUnitType*>(reinterpret_cast<uint8_t*>(m_Bitmap) + summaryOffset);
+    m_SummaryTop = m_Summary + m_SummaryUnitCount;
+    memset(m_Summary, 0, (m_SummaryUnitCount + m_SummaryTopUnitCount) * sizeof(SummaryUnitType));
+#endif
+
     // process free regions first
     for (size_t i = 0; i < regionCount; i++)
     {
@@ -51,12 +83,13 @@ bool BitmapAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
     }
 
     // mark region used by bitmap
-    MarkRegion(m_Bitmap, m_BitmapSize, true);
+    MarkRegion(m_Bitmap, totalSize, true);
 
     return true;
 }
 
-ptr_t BitmapAllocator::Allocate(uint32_t blocks) 
+template<typename TUnit>
+ptr_t BasicBitmapAllocator<TUnit>::Allocate(uint32_t blocks) 
 {
     if (blocks == 0)
         return nullptr;
@@ -69,12 +102,14 @@ ptr_t BitmapAllocator::Allocate(uint32_t blocks)
     return ToPtr(pickedRegion);
 }
 
-void BitmapAllocator::Free(ptr_t base, uint32_t blocks)
+template<typename TUnit>
+void BasicBitmapAllocator<TUnit>::Free(ptr_t base, uint32_t blocks)
 {
     MarkRegion(base, m_BlockSize * blocks, false);
 }
 
-void BitmapAllocator::MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed)
+template<typename TUnit>
+void BasicBitmapAllocator<TUnit>::MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed)
 {
     uint64_t base; 
     size_t size;
@@ -91,31 +126,123 @@ void BitmapAllocator::MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed)
     MarkBlocks(base, size, isUsed);
 }
 
-void BitmapAllocator::MarkBlocks(uint64_t base, size_t size, bool isUsed)
+template<typename TUnit>
+void BasicBitmapAllocator<TUnit>::MarkBlocks(uint64_t base, size_t size, bool isUsed)
+{
+    if (size == 0)
+        return;
+
+    FillBits(m_Bitmap, base, size, isUsed);
+
+#if BITMAP_SUMMARY
+    UpdateSummary(base / BlocksPerUnit, (base + size - 1) / BlocksPerUnit);
+#endif
+}
+
+template<typename TUnit>
+uint64_t BasicBitmapAllocator<TUnit>::SkipUnits(uint64_t unit, uint64_t endUnit, uint8_t value)
 {
-    // partial byte at the beginning
-    for (; base % 8 && size > 0; ++base, --size)
-        Set(base, isUsed);
+    auto* bytes = reinterpret_cast<const uint8_t*>(m_Bitmap);
+    uint64_t index = FindFirstNotEqual(bytes, unit * sizeof(BitmapUnitType), endUnit * sizeof(BitmapUnitType), value);
+    return index / sizeof(BitmapUnitType);
+}
+
+#if BITMAP_SUMMARY
+template<typename TUnit>
+void BasicBitmapAllocator<TUnit>::UpdateSummary(uint64_t firstUnit, uint64_t lastUnit)
+{
+    for (uint64_t unit = firstUnit; unit <= lastUnit; unit++)
+    {
+        auto bit = static_cast<SummaryUnitType>(1) << (unit % BitsPerSummaryUnit);
+        if (m_Bitmap[unit] != FullUnit)
+            m_Summary[unit / BitsPerSummaryUnit] |= bit;
+        else
+            m_Summary[unit / BitsPerSummaryUnit] &= ~bit;
+    }
+
+    for (uint64_t i = firstUnit / BitsPerSummaryUnit; i <= lastUnit / BitsPerSummaryUnit; i++)
+    {
+        auto bit = static_cast<SummaryUnitType>(1) << (i % BitsPerSummaryUnit);
+        if (m_Summary[i] != 0)
+            m_SummaryTop[i / BitsPerSummaryUnit] |= bit;
+        else
+            m_SummaryTop[i / BitsPerSummaryUnit] &= ~bit;
+    }
+}
+
+#endif
+
+template<typename TUnit>
+uint64_t BasicBitmapAllocator<TUnit>::NextFreeUnit(uint64_t unit)
+{
+    if (unit >= m_UnitCount)
+        return m_UnitCount;
+
+#if BITMAP_SUMMARY
+    // look at the rest of the current summary unit
+    uint64_t i = unit / BitsPerSummaryUnit;
+    SummaryUnitType bits = m_Summary[i] & (static_cast<SummaryUnitType>(-1) << (unit % BitsPerSummaryUnit));
+    if (bits != 0)
+        return i * BitsPerSummaryUnit + CountTrailingZeros(bits);
+
+    // use the top level to find the next summary unit which is not empty
+    for (++i; i < m_SummaryUnitCount; i = (i / BitsPerSummaryUnit + 1) * BitsPerSummaryUnit)
+    {
+        SummaryUnitType top = m_SummaryTop[i / BitsPerSummaryUnit] & (static_cast<SummaryUnitType>(-1) << (i % BitsPerSummaryUnit));
+        if (top != 0)
+        {
+            i = (i / BitsPerSummaryUnit) * BitsPerSummaryUnit + CountTrailingZeros(top);
+            return i * BitsPerSummaryUnit + CountTrailingZeros(m_Summary[i]);
+        }
+    }
+
+    return m_UnitCount;
+#else
+    // no summary, skip all the fully used units
+    return SkipUnits(unit, m_UnitCount, 0xFF);
+#endif
+}
+
+template<typename TUnit>
+bool BasicBitmapAllocator<TUnit>::FindFreeRun(uint64_t start, uint64_t limit, uint64_t& runStart, uint64_t& runSize)
+{
+    if (start >= m_MemSize)
+        return false;
+
+    // find the first free block, ignoring the blocks before 'start' in the first unit
+    uint64_t unit = start / BlocksPerUnit;
+    auto free = static_cast<BitmapUnitType>(~m_Bitmap[unit] & static_cast<BitmapUnitType>(FullUnit << (start % BlocksPerUnit)));
+    while (free == 0)
+    {
+        unit = NextFreeUnit(unit + 1);
+        if (unit >= m_UnitCount)
+            return false;
+
+        free = static_cast<BitmapUnitType>(~m_Bitmap[unit]);
+    }
 
-    // entire bytes in the middle
-    if (size >= 8)
+    runStart = unit * BlocksPerUnit + CountTrailingZeros(free);
+
+    // find the first used block after the start of the run; entirely free units are skipped at once
+    uint64_t endUnit = (limit >= m_MemSize) ? m_UnitCount : std::min(m_UnitCount, (runStart + limit) / BlocksPerUnit + 1);
+    auto used = static_cast<BitmapUnitType>(m_Bitmap[unit] & static_cast<BitmapUnitType>(FullUnit << (runStart % BlocksPerUnit)));
+    while (used == 0 && ++unit < endUnit)
     {
-        memset(reinterpret_cast<uint8_t*>(m_Bitmap) + base / 8, 
-               isUsed ? 0xFF : 0,
-               size / 8);
-        base += (size - size % 8);
-        size = size % 8;
+        unit = SkipUnits(unit, endUnit, 0);
+        if (unit < endUnit)
+            used = m_Bitmap[unit];
     }
 
-    // partial byte at the end
-    for (; size > 0; ++base, --size)
-        Set(base, isUsed);
+    uint64_t runEnd = unit * BlocksPerUnit + ((used != 0) ? CountTrailingZeros(used) : 0);
+    runSize = std::min(runEnd, m_MemSize) - runStart;
+    return true;
 }
 
 // for statistics
-RegionType BitmapAllocator::GetState(ptr_t address)
+template<typename TUnit>
+RegionType BasicBitmapAllocator<TUnit>::GetState(ptr_t address)
 {
-    if (address >= m_Bitmap && address < reinterpret_cast<uint8_t*>(m_Bitmap) + m_BitmapSize)
+    if (address >= m_Bitmap && address < reinterpret_cast<uint8_t*>(m_Bitmap) + m_BitmapSize + m_SummarySize)
         return RegionType::Allocator;
 
     uint64_t base = ToBlock(address);
@@ -125,9 +252,11 @@ RegionType BitmapAllocator::GetState(ptr_t address)
     return Get(base) ? RegionType::Reserved : RegionType::Free;
 }
 
-void BitmapAllocator::DumpImpl(JsonWriter& writer)
+template<typename TUnit>
+void BasicBitmapAllocator<TUnit>::DumpImpl(JsonWriter& writer)
 {
     writer.Property("bitmapSize", m_BitmapSize);
+    writer.Property("summarySize", m_SummarySize);
 
     std::stringstream bitmap;
     for (size_t i = 0; i < m_MemSize; i++)
@@ -136,188 +265,165 @@ void BitmapAllocator::DumpImpl(JsonWriter& writer)
     writer.Property("bitmap", bitmap.str());
 }
 
-uint64_t BitmapAllocator::MeasureWastedMemory()
+template<typename TUnit>
+uint64_t BasicBitmapAllocator<TUnit>::MeasureWastedMemory()
 {
-    return DivRoundUp(sizeof(*this) + m_BitmapSize, m_BlockSize);
+    return DivRoundUp(sizeof(*this) + m_BitmapSize + m_SummarySize, m_BlockSize);
 }
 
-uint64_t BitmapAllocatorFirstFit::FindFreeRegion(uint32_t blocks)
+template<typename TUnit>
+uint64_t BasicBitmapAllocatorFirstFit<TUnit>::FindFreeRegion(uint32_t blocks)
 {
-    uint64_t currentRegionStart = 0;
-    size_t currentRegionSize = 0;
+    // free run which reaches the end of the previous unit
+    uint64_t carryStart = 0;
+    uint64_t carrySize = 0;
 
-    for (uint64_t i = 0; i <= m_MemSize / BlocksPerUnit; i++)
+    for (uint64_t unit = this->NextFreeUnit(0); unit < this->m_UnitCount; )
     {
-        // used
-        if (m_Bitmap[i] == static_cast<BitmapUnitType>(-1))
+        TUnit used = this->m_Bitmap[unit];
+        auto free = static_cast<TUnit>(~used);
+
+        // continue the run from the previous unit
+        if (carrySize > 0)
+        {
+            uint64_t leading = (used == 0) ? Base::BlocksPerUnit : CountTrailingZeros(used);
+            if (carrySize + leading >= blocks)
+                return carryStart;
+        }
+
+        // run entirely inside this unit; for 1 block this is just the first free bit
+        if (blocks <= Base::BlocksPerUnit)
         {
-            currentRegionSize = 0;
-            currentRegionStart = i * BlocksPerUnit + 1;
+            int index = FindSetBitRun(free, blocks);
+            if (index >= 0)
+                return unit * Base::BlocksPerUnit + index;
+        }
+
+        // run which starts in this unit and continues in the next one
+        if (used == 0)
+        {
+            if (carrySize == 0)
+                carryStart = unit * Base::BlocksPerUnit;
+            carrySize += Base::BlocksPerUnit;
         }
         else
         {
-            BitmapUnitType val = m_Bitmap[i];
-            for (size_t off = 0; off < BlocksPerUnit && (i * BlocksPerUnit + off) < m_MemSize; off++, val>>=1)
-            {
-                // region is used
-                if (val & 1)
-                {
-                    currentRegionSize = 0;
-                    currentRegionStart = i * BlocksPerUnit + off + 1;
-                }
-                else
-                {
-                    currentRegionSize++;
-                    if (currentRegionSize >= blocks)
-                        return currentRegionStart;
-                }
-            }
+            carrySize = CountTopZeroBits(used);
+            carryStart = (unit + 1) * Base::BlocksPerUnit - carrySize;
         }
+
+        // a run can only continue in the next unit, otherwise jump to the next unit with free blocks
+        unit = (carrySize > 0) ? unit + 1 : this->NextFreeUnit(unit + 1);
     }
 
     return INVALID_BLOCK;
 }
 
 
-BitmapAllocatorNextFit::BitmapAllocatorNextFit()
-    : BitmapAllocator(),
+template<typename TUnit>
+BasicBitmapAllocatorNextFit<TUnit>::BasicBitmapAllocatorNextFit()
+    : Base(),
       m_Next(0)
 {
 }
     
-uint64_t BitmapAllocatorNextFit::FindFreeRegion(uint32_t blocks)
+template<typename TUnit>
+uint64_t BasicBitmapAllocatorNextFit<TUnit>::FindFreeRegion(uint32_t blocks)
 {
     // Next fit only makes sense if the block previous to m_Next is used
-    if (m_Next > 0 && !Get(m_Next - 1))
+    if (m_Next >= this->m_MemSize || (m_Next > 0 && !this->Get(m_Next - 1)))
         m_Next = 0;
 
-    size_t currentRegionSize = 0;
-    uint64_t currentRegionStart = m_Next % m_MemSize;
+    uint64_t runStart, runSize;
 
-    for (uint64_t it = 0; it < m_MemSize; it++)
+    // search from m_Next to the end of the memory
+    for (uint64_t start = m_Next; this->FindFreeRun(start, blocks, runStart, runSize); start = runStart + runSize)
     {
-        uint64_t i = (it + m_Next) % m_MemSize;
-        if (i == 0)
+        if (runSize >= blocks)
         {
-            currentRegionSize = 0;
-            currentRegionStart = 0;
+            m_Next = (runStart + 1) % this->m_MemSize;
+            return runStart;
         }
+    }
 
-        // used
-        if (Get(i))
-        {
-            currentRegionSize = 0;
-            currentRegionStart = i + 1;
-        }
-        else
+    // wrap around, and search the beginning of the memory
+    for (uint64_t start = 0; this->FindFreeRun(start, blocks, runStart, runSize) && runStart < m_Next; start = runStart + runSize)
+    {
+        if (runSize >= blocks)
         {
-            currentRegionSize++;
-            if (currentRegionSize >= blocks) {
-                m_Next = (currentRegionStart + 1) % m_MemSize;
-                return currentRegionStart;
-            }
+            m_Next = (runStart + 1) % this->m_MemSize;
+            return runStart;
         }
     }
 
     return INVALID_BLOCK;
 }
 
-uint64_t BitmapAllocatorBestFit::FindFreeRegion(uint32_t blocks)
+template<typename TUnit>
+uint64_t BasicBitmapAllocatorBestFit<TUnit>::FindFreeRegion(uint32_t blocks)
 {
-    uint64_t currentRegionStart = 0;
-    bool currentRegionType = Get(0);
-
     uint64_t pickedRegionStart = INVALID_BLOCK;
-    size_t pickedRegionSize = 0;
+    uint64_t pickedRegionSize = 0;
+    uint64_t runStart, runSize;
 
-    while (currentRegionStart < m_MemSize)
+    for (uint64_t start = 0; this->FindFreeRun(start, NO_LIMIT, runStart, runSize); start = runStart + runSize)
     {
-        // determine region size
-        size_t size;
-        uint64_t i;
-
-        for (i = currentRegionStart; i < m_MemSize; i++)
+        if (runSize >= blocks && (pickedRegionStart == INVALID_BLOCK || pickedRegionSize > runSize))
         {
-            if (i % BlocksPerUnit == 0 && 
-                (m_Bitmap[i / BlocksPerUnit] == static_cast<BitmapUnitType>(0) || 
-                 m_Bitmap[i / BlocksPerUnit] == static_cast<BitmapUnitType>(-1)))
-            {
-                auto value = m_Bitmap[i / BlocksPerUnit];
-                if ((value & 1) != currentRegionType)
-                    break;
-
-                i += BlocksPerUnit - 1;
-            }
-
-            else if (Get(i) != currentRegionType)
-                break;
-        }
+            pickedRegionStart = runStart;
+            pickedRegionSize = runSize;
 
-        size = i - currentRegionStart;
-
-        // check region type
-        if (!currentRegionType &&
-            size >= blocks && 
-            (pickedRegionStart == INVALID_BLOCK || pickedRegionSize > size))
-        {
-            pickedRegionStart = currentRegionStart;
-            pickedRegionSize = size;
+            // can't find a better fit than this
+            if (runSize == blocks)
+                break;
         }
-
-        // start next region
-        currentRegionStart = i;
-        currentRegionType = Get(i);
     }
 
     return pickedRegionStart;
 }
 
-uint64_t BitmapAllocatorWorstFit::FindFreeRegion(uint32_t blocks)
+template<typename TUnit>
+uint64_t BasicBitmapAllocatorWorstFit<TUnit>::FindFreeRegion(uint32_t blocks)
 {
-    uint64_t currentRegionStart = 0;
-    bool currentRegionType = Get(0);
-
     uint64_t pickedRegionStart = INVALID_BLOCK;
-    size_t pickedRegionSize = 0;
+    uint64_t pickedRegionSize = 0;
+    uint64_t runStart, runSize;
 
-    while (currentRegionStart < m_MemSize)
+    for (uint64_t start = 0; this->FindFreeRun(start, NO_LIMIT, runStart, runSize); start = runStart + runSize)
     {
-        // determine region size
-        size_t size;
-        uint64_t i;
-
-        for (i = currentRegionStart; i < m_MemSize; i++)
-        {
-            if (i % BlocksPerUnit == 0 && 
-                (m_Bitmap[i / BlocksPerUnit] == static_cast<BitmapUnitType>(0) || 
-                 m_Bitmap[i / BlocksPerUnit] == static_cast<BitmapUnitType>(-1)))
-            {
-                auto value = m_Bitmap[i / BlocksPerUnit];
-                if ((value & 1) != currentRegionType)
-                    break;
-
-                i += BlocksPerUnit - 1;
-            }
-
-            else if (Get(i) != currentRegionType)
-                break;
-        }
-
-        size = i - currentRegionStart;
-
-        // check region type
-        if (!currentRegionType &&
-            size >= blocks && 
-            (pickedRegionStart == INVALID_BLOCK || pickedRegionSize < size))
+        if (runSize >= blocks && (pickedRegionStart == INVALID_BLOCK || pickedRegionSize < runSize))
         {
-            pickedRegionStart = currentRegionStart;
-            pickedRegionSize = size;
+            pickedRegionStart = runStart;
+            pickedRegionSize = runSize;
         }
-
-        // start next region
-        currentRegionStart = i;
-        currentRegionType = Get(i);
     }
 
     return pickedRegionStart;
 }
+
+
+// instantiate the allocators for all the supported bitmap unit types
+template class BasicBitmapAllocator<uint8_t>;
+template class BasicBitmapAllocator<uint16_t>;
+template class BasicBitmapAllocator<uint32_t>;
+template class BasicBitmapAllocator<uint64_t>;
+
+template class BasicBitmapAllocatorFirstFit<uint8_t>;
+template class BasicBitmapAllocatorFirstFit<uint16_t>;
+template class BasicBitmapAllocatorFirstFit<uint32_t>;
+template class BasicBitmapAllocatorFirstFit<uint64_t>;
+
+template class BasicBitmapAllocatorNextFit<uint8_t>;
+template class BasicBitmapAllocatorNextFit<uint16_t>;
+template class BasicBitmapAllocatorNextFit<uint32_t>;
+template class BasicBitmapAllocatorNextFit<uint64_t>;
+
+template class BasicBitmapAllocatorBestFit<uint8_t>;
+template class BasicBitmapAllocatorBestFit<uint16_t>;
+template class BasicBitmapAllocatorBestFit<uint32_t>;
+template class BasicBitmapAllocatorBestFit<uint64_t>;
+
+template class BasicBitmapAllocatorWorstFit<uint8_t>;
+template class BasicBitmapAllocatorWorstFit<uint16_t>;
+template class BasicBitmapAllocatorWorstFit<uint32_t>;
+template class BasicBitmapAllocatorWorstFit<uint64_t>;
\ No newline at end of file
@@ -1,9 +1,15 @@
 #include "Allocator.hpp"
-
-class BitmapAllocator : public Allocator
+#include "../Config.hpp"
+
+/**
+ * Bitmap allocator, 1 bit for every block.
+ * TUnit is the word type used for storing/scanning the bitmap.
+ */
+template<typename TUnit = uint64_t>
+class BasicBitmapAllocator : public Allocator
 {
 public:
-    BitmapAllocator();
+    BasicBitmapAllocator();
     ptr_t Allocate(uint32_t blocks = 1) override;
     void Free(ptr_t base, uint32_t blocks) override;
     
@@ -20,6 +26,23 @@ protected:
     void MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed);
     void MarkBlocks(uint64_t base, size_t size, bool isUsed);
 
+    /**
+     * Finds the first run of free blocks which starts at or after 'start'.
+     * The size of the run is only measured until it reaches 'limit' blocks.
+     * Returns false if there are no more free blocks.
+     */
+    bool FindFreeRun(uint64_t start, uint64_t limit, uint64_t& runStart, uint64_t& runSize);
+
+    // returns the first unit in [unit, endUnit) which is not entirely made of 'value' bytes
+    uint64_t SkipUnits(uint64_t unit, uint64_t endUnit, uint8_t value);
+
+    // returns the first bitmap unit starting at 'unit' which contains free blocks
+    uint64_t NextFreeUnit(uint64_t unit);
+
+#if BITMAP_SUMMARY
+    void UpdateSummary(uint64_t firstUnit, uint64_t lastUnit);
+#endif
+
     inline bool Get(uint64_t block)
     {
         uint64_t addr = block / BlocksPerUnit;
@@ -37,25 +60,44 @@ protected:
             m_Bitmap[addr] &= ~(static_cast<BitmapUnitType>(1) << offset);
     }
 
-    typedef uint32_t BitmapUnitType;
+    typedef TUnit BitmapUnitType;
     static constexpr size_t BlocksPerUnit = sizeof(BitmapUnitType) * 8;
+    static constexpr BitmapUnitType FullUnit = static_cast<BitmapUnitType>(-1);
 
     BitmapUnitType* m_Bitmap;
     uint64_t m_BitmapSize;
+    uint64_t m_UnitCount;
+
+#if BITMAP_SUMMARY
+    typedef uint64_t SummaryUnitType;
+    static constexpr size_t BitsPerSummaryUnit = sizeof(SummaryUnitType) * 8;
+
+    SummaryUnitType* m_Summary;             // 1 bit for each bitmap unit
+    SummaryUnitType* m_SummaryTop;          // 1 bit for each summary unit
+    uint64_t m_SummaryUnitCount;
+    uint64_t m_SummaryTopUnitCount;
+#endif
+    uint64_t m_SummarySize;
 };
 
 
-class BitmapAllocatorFirstFit : public BitmapAllocator
+template<typename TUnit = uint64_t>
+class BasicBitmapAllocatorFirstFit : public BasicBitmapAllocator<TUnit>
 {
+    typedef BasicBitmapAllocator<TUnit> Base;
+
 protected:
     uint64_t FindFreeRegion(uint32_t blocks) override;
 };
 
 
-class BitmapAllocatorNextFit : public BitmapAllocator
+template<typename TUnit = uint64_t>
+class BasicBitmapAllocatorNextFit : public BasicBitmapAllocator<TUnit>
 {
+    typedef BasicBitmapAllocator<TUnit> Base;
+
 public:
-    BitmapAllocatorNextFit();
+    BasicBitmapAllocatorNextFit();
 
 protected:
     uint64_t FindFreeRegion(uint32_t blocks) override;
@@ -65,15 +107,28 @@ private:
 };
 
 
-class BitmapAllocatorBestFit : public BitmapAllocator
+template<typename TUnit = uint64_t>
+class BasicBitmapAllocatorBestFit : public BasicBitmapAllocator<TUnit>
 {
+    typedef BasicBitmapAllocator<TUnit> Base;
+
 protected:
     uint64_t FindFreeRegion(uint32_t blocks) override;
 };
 
 
-class BitmapAllocatorWorstFit : public BitmapAllocator
+template<typename TUnit = uint64_t>
+class BasicBitmapAllocatorWorstFit : public BasicBitmapAllocator<TUnit>
 {
+    typedef BasicBitmapAllocator<TUnit> Base;
+
 protected:
     uint64_t FindFreeRegion(uint32_t blocks) override;
-};
\ No newline at end of file
+};
+
+
+using BitmapAllocator = BasicBitmapAllocator<>;
+using BitmapAllocatorFirstFit = BasicBitmapAllocatorFirstFit<>;
+using BitmapAllocatorNextFit = BasicBitmapAllocatorNextFit<>;
+using BitmapAllocatorBestFit = BasicBitmapAllocatorBestFit<>;
+using BitmapAllocatorWorstFit = BasicBitmapAllocatorWorstFit<>;
\ No newline at end of file
@@ -3,16 +3,24 @@
 #include <util/JsonWriter.hpp>
 #include <Debug.hpp>
 #include <memory.h>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 
-BuddyAllocator::BuddyAllocator()
+template<int TLayerCount, bool TExactSize>
+BasicBuddyAllocator<TLayerCount, TExactSize>::BasicBuddyAllocator()
     : Allocator(),
       m_SmallBlockSize(),
       m_BigBlockSize(),
 	  m_Bitmap(nullptr),
 	  m_BitmapSize(),
 	  m_BlocksLayer0(),
+      m_LayerIndex(),
+#if BUDDY_RUN_INDEX
+      m_RunTree(nullptr),
+      m_RunTreeLeaves(0),
+#endif
+      m_RunTreeSize(0),
       m_LastAllocatedBlock(0),
 	  m_LastAllocatedCount(0),
       m_LastAllocatedLayer(-1),
@@ -20,33 +28,54 @@ BuddyAllocator::BuddyAllocator()
 {
 }
 
-bool BuddyAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
+template<int TLayerCount, bool TExactSize>
+bool BasicBuddyAllocator<TLayerCount, TExactSize>::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 {
     m_SmallBlockSize = m_BlockSize;
-    m_BigBlockSize = m_BlockSize * BIG_BLOCK_MULTIPLIER;
+    m_BigBlockSize = m_BlockSize * BigBlockMultiplier;
     m_BlocksLayer0 = DivRoundUp(m_MemSizeBytes, m_BigBlockSize);
-    m_BitmapSize = IndexOfLayer(LAYER_COUNT);
+
+    // every layer starts on a new bitmap unit
+    m_LayerIndex[0] = 0;
+    for (int layer = 0; layer < LayerCount; layer++)
+        m_LayerIndex[layer + 1] = m_LayerIndex[layer] + DivRoundUp(BlocksOnLayer(layer), static_cast<uint64_t>(BitmapUnit));
+
+    m_BitmapSize = IndexOfLayer(LayerCount) * sizeof(BitmapUnitType);
+
+#if BUDDY_RUN_INDEX
+    // run tree is placed right after the bitmap
+    m_RunTreeLeaves = RoundToPowerOf2(m_BlocksLayer0);
+    m_RunTreeSize = 2 * m_RunTreeLeaves * sizeof(BuddyRunNode);
+#endif
+
+    uint64_t totalSize = m_BitmapSize + m_RunTreeSize;
 
     // Find free region to fit BitmapSize
     RegionBlocks *freeRegion = nullptr;
     for (size_t i = 0; i < regionCount; i++)
     {
-        if (regions[i].Type == RegionType::Free && regions[i].Size * m_BlockSize >= m_BitmapSize)
+        if (regions[i].Type == RegionType::Free && regions[i].Size * m_BlockSize >= totalSize)
             freeRegion = &regions[i];
     }
 
     // no free space :(
     if (freeRegion == nullptr)
     {
-        Debug::Error("BuddyAllocator", "Not enough free memory - needed %u!", m_BitmapSize);
+        Debug::Error("BuddyAllocator", "Not enough free memory - needed %u!", totalSize);
         return false;
     }
 
-    m_Bitmap = reinterpret_cast<uint8_t*>(ToPtr(freeRegion->Base));
+    m_Bitmap = reinterpret_cast<BitmapUnitType*>(ToPtr(freeRegion->Base));
 
     // initialize bitmap with everything marked as "used"
     memset(m_Bitmap, 0xFF, m_BitmapSize);
 
+#if BUDDY_RUN_INDEX
+    // nothing is free yet, so there are no runs
+    m_RunTree = reinterpret_cast<BuddyRunNode*>(reinterpret_cast<uint8_t*>(m_Bitmap) + m_BitmapSize);
+    memset(m_RunTree, 0, m_RunTreeSize);
+#endif
+
     // process free regions first
     for (size_t i = 0; i < regionCount; i++)
     {
@@ -60,12 +89,13 @@ bool BuddyAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
     }
 
     // mark region used by bitmap as used
-    MarkRegion(m_Bitmap, m_BitmapSize, true);
+    MarkRegion(m_Bitmap, totalSize, true);
 
     return true;
 }
 
-ptr_t BuddyAllocator::Allocate(uint32_t blocks) 
+template<int TLayerCount, bool TExactSize>
+ptr_t BasicBuddyAllocator<TLayerCount, TExactSize>::Allocate(uint32_t blocks) 
 {
     if (blocks == 0)
         return nullptr;
@@ -73,8 +103,23 @@ ptr_t BuddyAllocator::Allocate(uint32_t blocks)
     // number of blocks is larger than any block size we store in the bitmaps
     // so we need to search using the same tactic as in the bitmap allocator
     // but on the last layer (with the biggest blocks)
-    if (blocks > BIG_BLOCK_MULTIPLIER)
+    if (blocks > BigBlockMultiplier)
     {
+#if BUDDY_RUN_INDEX
+        // the run tree tells us where the first long enough run is
+        uint64_t count = DivRoundUp(static_cast<uint64_t>(blocks), BigBlockMultiplier);
+        uint64_t start = FindFreeRun(count);
+        if (start != (uint64_t)-1)
+        {
+            m_LastAllocatedBlock = start;
+            m_LastAllocatedCount = count;
+            m_LastAllocatedLayer = 0;
+
+            uint64_t base = start * BigBlockMultiplier;
+            MarkBlocks(base, blocks, true);
+            return ToPtr(base);
+        }
+#else
         size_t currentRegionCount = 0;
         uint64_t currentRegionStart = 0;
 
@@ -89,18 +134,19 @@ ptr_t BuddyAllocator::Allocate(uint32_t blocks)
             else
             {
                 currentRegionCount++;
-                if (currentRegionCount * BIG_BLOCK_MULTIPLIER >= blocks)
+                if (currentRegionCount * BigBlockMultiplier >= blocks)
                 {
                     m_LastAllocatedBlock = currentRegionStart;
                     m_LastAllocatedCount = currentRegionCount;
                     m_LastAllocatedLayer = 0;
 
-                    uint64_t base = currentRegionStart * BIG_BLOCK_MULTIPLIER;
+                    uint64_t base = currentRegionStart * BigBlockMultiplier;
                     MarkBlocks(base, blocks, true);
                     return ToPtr(base);
                 }
             }
         }
+#endif
     }
     else
     {
@@ -114,29 +160,28 @@ ptr_t BuddyAllocator::Allocate(uint32_t blocks)
 
         // if we are on a lower level than "layer", we need to split all the blocks all the way to "layer"
         // always split on the left side
-	    uint64_t i = iFound;
-        for (int l = layerFound; l < layer; l++, i <<= 1)
-            Set(l, i, true);
-
-        // bubble down - mark blocks below as used
-        uint64_t iBubble = i << 1;
-        int countBubble = 2;
-        for (int l = layer + 1; l < LAYER_COUNT; l++, iBubble <<= 1, countBubble <<= 1)
-        {
-            SetBulk(l, iBubble, countBubble, true);
-        }
+        uint64_t i = iFound << (layer - layerFound);
 
-        // i points to index of block we want to return
-        Set(layer, i, true);
+        // i points to index of block we want to return; marking it as used also marks
+        // the split blocks above it, and everything below it
+        uint64_t base = i * (1ull << (LayerCount - 1 - layer));
         m_LastAllocatedBlock = i;
         m_LastAllocatedCount = 1;
         m_LastAllocatedLayer = layer;
 
+        // in exact size mode, the unused tail of the block stays free
+        if (TExactSize)
+        {
+            MarkBlocks(base, blocks, true);
+            return ToPtr(base);
+        }
+
+        MarkBlocks(base, 1ull << (LayerCount - 1 - layer), true);
+
 #ifdef MEASURE_WASTE
         m_Waste += RoundToPowerOf2(blocks) - blocks;
 #endif
 
-        uint64_t base = i * (1ull << (LAYER_COUNT - 1 - layer));
         return ToPtr(base);
     }
 
@@ -144,7 +189,8 @@ ptr_t BuddyAllocator::Allocate(uint32_t blocks)
     return nullptr;
 }
 
-uint64_t BuddyAllocator::FindFreeBlock(int& layer)
+template<int TLayerCount, bool TExactSize>
+uint64_t BasicBuddyAllocator<TLayerCount, TExactSize>::FindFreeBlock(int& layer)
 {
     // search for free blocks on lower levels
     for(; layer > 0; layer--)
@@ -152,15 +198,15 @@ uint64_t BuddyAllocator::FindFreeBlock(int& layer)
         auto layerIndex = IndexOfLayer(layer);
         auto layerCount = BlocksOnLayer(layer);
 
-        for (uint64_t i = 0; i < layerCount / BitmapUnit; i++)
+        for (uint64_t i = 0; i < DivRoundUp(layerCount, static_cast<uint64_t>(BitmapUnit)); i++)
         {
             // a block is considered free if its buddy is used (e.g. 01 or 10)
             auto value = m_Bitmap[layerIndex + i];
-            auto pairs = ((value & 0xAA) >> 1) ^ (value & 0x55);
+            auto pairs = ((value & 0xAAAAAAAAAAAAAAAAull) >> 1) ^ (value & 0x5555555555555555ull);
             if (pairs != 0)
             {
-                auto index = Log2(pairs);
-                if ((value & (1 << index)) == 0)
+                auto index = CountTrailingZeros(pairs);
+                if ((value & (static_cast<BitmapUnitType>(1) << index)) == 0)
                     return (i * BitmapUnit) + index;
                 else
                     return (i * BitmapUnit) + index + 1;
@@ -180,10 +226,11 @@ uint64_t BuddyAllocator::FindFreeBlock(int& layer)
     return (uint64_t)-1;
 }
 
-void BuddyAllocator::Free(ptr_t base, uint32_t blocks)
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocator<TLayerCount, TExactSize>::Free(ptr_t base, uint32_t blocks)
 {
     // figure out closest layer
-    if (blocks <= BIG_BLOCK_MULTIPLIER)
+    if (blocks <= BigBlockMultiplier && !TExactSize)
     {
 #ifdef MEASURE_WASTE
         m_Waste -= RoundToPowerOf2(blocks) - blocks;
@@ -196,74 +243,144 @@ void BuddyAllocator::Free(ptr_t base, uint32_t blocks)
     }
 }
 
-void BuddyAllocator::MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed)
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocator<TLayerCount, TExactSize>::MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed)
 {
     uint64_t base = ToBlock(basePtr);
     size_t size = DivRoundUp(sizeBytes, m_SmallBlockSize);
     MarkBlocks(base, size, isUsed);
 }
 
-void BuddyAllocator::MarkBlocks(uint64_t block, size_t count, bool isUsed)
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocator<TLayerCount, TExactSize>::MarkBlocks(uint64_t block, size_t count, bool isUsed)
 {
+    if (count == 0)
+        return;
+
     // start by marking everything on the last layer
-    SetBulk(LAYER_COUNT - 1, block, count, isUsed);
+    SetBulk(LayerCount - 1, block, count, isUsed);
 
-    // bubble up all the way to layer 0
-    for (int layer = LAYER_COUNT - 2; layer >= 0; layer--)
+    // bubble up all the way to layer 0, rebuilding the affected parent units
+    // 1 unit at a time from the 2 child units below them
+    uint64_t last = block + count - 1;
+    for (int layer = LayerCount - 2; layer >= 0; layer--)
     {
         block /= 2;
-        count = DivRoundUp(count, 2UL);
-        for (uint64_t i = block; i < block + count; i++)
+        last /= 2;
+
+        BitmapUnitType* parent = m_Bitmap + IndexOfLayer(layer);
+        BitmapUnitType* child = m_Bitmap + IndexOfLayer(layer + 1);
+        uint64_t childUnits = IndexOfLayer(layer + 2) - IndexOfLayer(layer + 1);
+
+        for (uint64_t unit = block / BitmapUnit; unit <= last / BitmapUnit; unit++)
         {
-            bool val = Get(layer + 1, i * 2) || Get(layer + 1, i * 2 + 1);
-            Set(layer, i, val);
+            // missing child units only cover padding, which is always used
+            BitmapUnitType low = child[unit * 2];
+            BitmapUnitType high = (unit * 2 + 1 < childUnits) ? child[unit * 2 + 1] : ~static_cast<BitmapUnitType>(0);
+            parent[unit] = OrCompressPairs(low) | (static_cast<BitmapUnitType>(OrCompressPairs(high)) << (BitmapUnit / 2));
         }
     }
+
+#if BUDDY_RUN_INDEX
+    UpdateRunTree(block, last);
+#endif
 }
 
-void BuddyAllocator::SetBulk(int layer, uint64_t base, uint64_t count, bool isUsed)
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocator<TLayerCount, TExactSize>::SetBulk(int layer, uint64_t base, uint64_t count, bool isUsed)
 {
-    // partial byte at the beginning
-    for (; base % 8 && count > 0; ++base, --count)
-        Set(layer, base, isUsed);
+    FillBits(m_Bitmap + IndexOfLayer(layer), base, count, isUsed);
+}
 
-    // entire bytes in the middle
-    if (count >= 8)
+#if BUDDY_RUN_INDEX
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocator<TLayerCount, TExactSize>::UpdateRunTree(uint64_t first, uint64_t last)
+{
+    // leaves
+    for (uint64_t i = first; i <= last; i++)
     {
-        memset(reinterpret_cast<uint8_t*>(m_Bitmap) + IndexOfLayer(layer) + base / 8, isUsed ? 0xFF : 0, count / 8);
-        base += (count - count % 8);
-        count = count % 8;
+        uint32_t free = Get(0, i) ? 0 : 1;
+        m_RunTree[m_RunTreeLeaves + i] = { free, free, free };
     }
 
-    // partial byte at the end
-    for (; count > 0; ++base, --count)
-        Set(layer, base, isUsed);
+    // bubble up to the root
+    first += m_RunTreeLeaves;
+    last += m_RunTreeLeaves;
+    for (uint32_t half = 1; first > 1; half *= 2)
+    {
+        first /= 2;
+        last /= 2;
+        for (uint64_t i = first; i <= last; i++)
+        {
+            const BuddyRunNode& left = m_RunTree[i * 2];
+            const BuddyRunNode& right = m_RunTree[i * 2 + 1];
+
+            m_RunTree[i].Prefix = (left.Prefix == half) ? half + right.Prefix : left.Prefix;
+            m_RunTree[i].Suffix = (right.Suffix == half) ? half + left.Suffix : right.Suffix;
+            m_RunTree[i].Longest = std::max(std::max(left.Longest, right.Longest), left.Suffix + right.Prefix);
+        }
+    }
+}
+
+template<int TLayerCount, bool TExactSize>
+uint64_t BasicBuddyAllocator<TLayerCount, TExactSize>::FindFreeRun(uint64_t count)
+{
+    if (m_RunTree[1].Longest < count)
+        return (uint64_t)-1;
+
+    // go down the tree, always picking the leftmost subtree which contains a big enough run
+    uint64_t i = 1;
+    uint64_t base = 0;
+    for (uint64_t half = m_RunTreeLeaves / 2; half > 0; half /= 2)
+    {
+        const BuddyRunNode& left = m_RunTree[i * 2];
+        const BuddyRunNode& right = m_RunTree[i * 2 + 1];
+
+        if (left.Longest >= count)
+            i = i * 2;
+
+        // run crosses the middle
+        else if (left.Suffix + right.Prefix >= count)
+            return base + half - left.Suffix;
+
+        else
+        {
+            i = i * 2 + 1;
+            base += half;
+        }
+    }
+
+    return base;
 }
+#endif
 
 
 // for statistics
-RegionType BuddyAllocator::GetState(ptr_t address)
+template<int TLayerCount, bool TExactSize>
+RegionType BasicBuddyAllocator<TLayerCount, TExactSize>::GetState(ptr_t address)
 {
-    if (address >= m_Bitmap && address < m_Bitmap + m_BitmapSize)
+    if (address >= m_Bitmap && address < reinterpret_cast<uint8_t*>(m_Bitmap) + m_BitmapSize + m_RunTreeSize)
         return RegionType::Allocator;
 
     uint64_t base = ToBlock(address);
-    if (base >= BlocksOnLayer(LAYER_COUNT - 1))
+    if (base >= m_MemSize)
         return RegionType::Unmapped;
 
-    return Get(LAYER_COUNT - 1, base) ? RegionType::Reserved : RegionType::Free;
+    return Get(LayerCount - 1, base) ? RegionType::Reserved : RegionType::Free;
 }
 
-void BuddyAllocator::DumpImpl(JsonWriter& writer)
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocator<TLayerCount, TExactSize>::DumpImpl(JsonWriter& writer)
 {
     writer.Property("smallBlockSize", m_SmallBlockSize);
     writer.Property("bigBlockSize", m_BigBlockSize);
     writer.Property("bitmapSize", m_BitmapSize);
+    writer.Property("runTreeSize", m_RunTreeSize);
     writer.Property("blocksLayer0", m_BlocksLayer0);
 
     writer.BeginObject("bitmap");
 
-    for (int layer = 0; layer < LAYER_COUNT; layer++)
+    for (int layer = 0; layer < LayerCount; layer++)
     {
         std::stringstream bitmap;
         for (size_t i = 0; i < BlocksOnLayer(layer); i++) {
@@ -288,7 +405,150 @@ void BuddyAllocator::DumpImpl(JsonWriter& writer)
     writer.EndObject();
 }
 
-uint64_t BuddyAllocator::MeasureWastedMemory()
+template<int TLayerCount, bool TExactSize>
+uint64_t BasicBuddyAllocator<TLayerCount, TExactSize>::MeasureWastedMemory()
 {
-    return DivRoundUp(sizeof(*this) + m_BitmapSize, m_BlockSize) + m_Waste;
+    return DivRoundUp(sizeof(*this) + m_BitmapSize + m_RunTreeSize, m_BlockSize) + m_Waste;
 }
+
+
+template<int TLayerCount, bool TExactSize>
+BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::BasicBuddyAllocatorFreeList()
+    : Base(),
+      m_FreeLists(),
+      m_FreeListsReady(false)
+{
+}
+
+template<int TLayerCount, bool TExactSize>
+bool BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::InitializeImpl(RegionBlocks regions[], size_t regionCount)
+{
+    // the lists can only be built once the bitmap is ready, otherwise the nodes
+    // could end up overwriting the bitmap
+    m_FreeListsReady = false;
+    for (int layer = 0; layer < TLayerCount; layer++)
+        m_FreeLists[layer] = nullptr;
+
+    if (!Base::InitializeImpl(regions, regionCount))
+        return false;
+
+    ForEachFreeBlock(0, this->BlocksOnLayer(TLayerCount - 1), false, [this](int layer, uint64_t index) { LinkBlock(layer, index); });
+    m_FreeListsReady = true;
+    return true;
+}
+
+template<int TLayerCount, bool TExactSize>
+uint64_t BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::FindFreeBlock(int& layer)
+{
+    // take the smallest free block that fits
+    for (; layer >= 0; layer--)
+    {
+        if (m_FreeLists[layer] != nullptr)
+            return this->ToBlock(m_FreeLists[layer]) >> (TLayerCount - 1 - layer);
+    }
+
+    // out of memory
+    layer = 0;
+    return (uint64_t)-1;
+}
+
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::MarkBlocks(uint64_t block, size_t count, bool isUsed)
+{
+    if (!m_FreeListsReady)
+    {
+        Base::MarkBlocks(block, count, isUsed);
+        return;
+    }
+
+    // only the free blocks around the marked blocks can change; the marked blocks are
+    // all free before an allocation and all used before a free, so only the blocks on
+    // the edges of the range have to be visited
+    ForEachFreeBlock(block, count, !isUsed, [this](int layer, uint64_t index) { UnlinkBlock(layer, index); });
+    Base::MarkBlocks(block, count, isUsed);
+    ForEachFreeBlock(block, count, isUsed, [this](int layer, uint64_t index) { LinkBlock(layer, index); });
+}
+
+template<int TLayerCount, bool TExactSize>
+template<typename TCallback>
+void BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::ForEachFreeBlock(uint64_t block, size_t count, bool rangeUsed, TCallback callback)
+{
+    if (count == 0)
+        return;
+
+    uint64_t last = block + count - 1;
+    for (uint64_t i = block >> (TLayerCount - 1); i <= last >> (TLayerCount - 1); i++)
+        ForEachFreeBlock(0, i, block, last, rangeUsed, callback);
+}
+
+template<int TLayerCount, bool TExactSize>
+template<typename TCallback>
+void BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::ForEachFreeBlock(int layer, uint64_t index, uint64_t first, uint64_t last, bool rangeUsed, TCallback callback)
+{
+    // free block whose parent is used
+    if (!this->Get(layer, index))
+    {
+        callback(layer, index);
+        return;
+    }
+
+    if (layer == TLayerCount - 1)
+        return;
+
+    // a block inside a used range has no free blocks below it
+    int shift = TLayerCount - 2 - layer;
+    if (rangeUsed && (index << (shift + 1)) >= first && ((index + 1) << (shift + 1)) - 1 <= last)
+        return;
+
+    // the children covering the marked blocks are visited; the other child's parent
+    // can change, so it is also affected if it's free
+    for (uint64_t child = index * 2; child <= index * 2 + 1; child++)
+    {
+        uint64_t childFirst = child << shift;
+        uint64_t childLast = childFirst + (1ull << shift) - 1;
+
+        if (childFirst <= last && childLast >= first)
+            ForEachFreeBlock(layer + 1, child, first, last, rangeUsed, callback);
+        else if (!this->Get(layer + 1, child))
+            callback(layer + 1, child);
+    }
+}
+
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::LinkBlock(int layer, uint64_t index)
+{
+    BuddyFreeNode* node = ToNode(layer, index);
+    node->Prev = nullptr;
+    node->Next = m_FreeLists[layer];
+
+    if (node->Next != nullptr)
+        node->Next->Prev = node;
+
+    m_FreeLists[layer] = node;
+}
+
+template<int TLayerCount, bool TExactSize>
+void BasicBuddyAllocatorFreeList<TLayerCount, TExactSize>::UnlinkBlock(int layer, uint64_t index)
+{
+    BuddyFreeNode* node = ToNode(layer, index);
+
+    if (node->Prev == nullptr)
+        m_FreeLists[layer] = node->Next;
+    else
+        node->Prev->Next = node->Next;
+
+    if (node->Next != nullptr)
+        node->Next->Prev = node->Prev;
+}
+
+
+// instantiate the allocators for the ready-made layer counts
+template class BasicBuddyAllocator<10>;
+template class BasicBuddyAllocator<5>;
+template class BasicBuddyAllocator<19>;
+template class BasicBuddyAllocator<10, true>;
+
+template class BasicBuddyAllocatorFreeList<10>;
+template class BasicBuddyAllocatorFreeList<5>;
+template class BasicBuddyAllocatorFreeList<19>;
+template class BasicBuddyAllocatorFreeList<10, true>;
\ No newline at end of file
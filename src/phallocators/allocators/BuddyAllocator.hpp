@@ -1,19 +1,41 @@
 #include "Allocator.hpp"
+#include "../Config.hpp"
 #include "../math/MathHelpers.hpp"
+#include "../math/BitScan.hpp"
 
-#define LAYER_COUNT 10
-
-// number that we multiply to size of smallest block to get the biggest block
-// (or how many smallest blocks we can fit in 1 biggest block)
-#define BIG_BLOCK_MULTIPLIER (1ull << (LAYER_COUNT - 1))
+/**
+ * Node of the free run tree, sizes are measured in top level blocks
+ */
+struct BuddyRunNode
+{
+    uint32_t Prefix;    // free blocks at the start of the subtree
+    uint32_t Suffix;    // free blocks at the end of the subtree
+    uint32_t Longest;   // longest run of free blocks in the subtree
+};
 
-class BuddyAllocator : public Allocator
+/**
+ * Buddy allocator with TLayerCount layers (orders). Blocks on the last layer
+ * have the size of 1 block, blocks on layer 0 have the size of 2^(TLayerCount-1) blocks.
+ *
+ * If TExactSize is set, allocations are not rounded up to a power of 2; the unused
+ * tail of the block is given back as smaller free buddies, and is merged back on free.
+ */
+template<int TLayerCount = 10, bool TExactSize = false>
+class BasicBuddyAllocator : public Allocator
 {
+    static_assert(TLayerCount > 0 && TLayerCount <= 32, "Invalid layer count!");
+
 public:
-    BuddyAllocator();
+    static constexpr int LayerCount = TLayerCount;
+
+    // number that we multiply to size of smallest block to get the biggest block
+    // (or how many smallest blocks we can fit in 1 biggest block)
+    static constexpr uint64_t BigBlockMultiplier = 1ull << (LayerCount - 1);
+
+    BasicBuddyAllocator();
     ptr_t Allocate(uint32_t blocks = 1) override;
     void Free(ptr_t base, uint32_t blocks) override;
-    
+
     // for statistics
     RegionType GetState(ptr_t address) override;
     uint64_t MeasureWastedMemory() override;
@@ -22,31 +44,30 @@ protected:
     bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override;
     void DumpImpl(JsonWriter& writer) override;
 
-private:
-    uint64_t FindFreeBlock(int& layer);
+    virtual uint64_t FindFreeBlock(int& layer);
     void MarkRegion(ptr_t basePtr, size_t sizeBytes, bool isUsed);
-    void MarkBlocks(uint64_t block, size_t count, bool isUsed);
+    virtual void MarkBlocks(uint64_t block, size_t count, bool isUsed);
 
     inline uint64_t BlocksOnLayer(int layer) const
     {
-        return (1ull << layer) * m_BlocksLayer0;
+        return m_BlocksLayer0 << layer;
     }
 
     inline uint64_t IndexOfLayer(int layer) const
     {
-        return DivRoundUp(m_BlocksLayer0, BitmapUnit) * ((1ull << layer) - 1);
+        return m_LayerIndex[layer];
     }
 
-    static inline int GetNearestLayer(int blocks)
+    static inline int GetNearestLayer(uint32_t blocks)
     {
-        return LAYER_COUNT - 1 - Log2(blocks) - (IsPowerOf2(blocks) ? 0 : 1);
+        return LayerCount - 1 - Log2(blocks) - (IsPowerOf2(blocks) ? 0 : 1);
     }
 
     inline bool Get(int layer, uint64_t block)
     {
         uint64_t addr = IndexOfLayer(layer) + block / BitmapUnit;
         uint64_t offset = block % BitmapUnit;
-        return (m_Bitmap[addr] & (1 << offset)) != 0;
+        return (m_Bitmap[addr] & (static_cast<BitmapUnitType>(1) << offset)) != 0;
     }
 
     inline void Set(int layer, uint64_t block, bool value)
@@ -54,19 +75,36 @@ private:
         uint64_t addr = IndexOfLayer(layer) + block / BitmapUnit;
         uint64_t offset = block % BitmapUnit;
         if (value)
-            m_Bitmap[addr] |= (1 << offset);
+            m_Bitmap[addr] |= (static_cast<BitmapUnitType>(1) << offset);
         else
-            m_Bitmap[addr] &= ~(1 << offset);
+            m_Bitmap[addr] &= ~(static_cast<BitmapUnitType>(1) << offset);
     }
 
     void SetBulk(int layer, uint64_t blockStart, uint64_t count, bool value);
 
+#if BUDDY_RUN_INDEX
+    // updates the run tree after the given top level blocks have changed
+    void UpdateRunTree(uint64_t first, uint64_t last);
+
+    // returns the first top level block of the first run of 'count' free top level blocks
+    uint64_t FindFreeRun(uint64_t count);
+#endif
+
     uint64_t m_SmallBlockSize;
     uint64_t m_BigBlockSize;
-    uint8_t* m_Bitmap;
+    typedef uint64_t BitmapUnitType;
+    static constexpr size_t BitmapUnit = sizeof(BitmapUnitType) * 8;
+
+    BitmapUnitType* m_Bitmap;
     uint64_t m_BitmapSize;
     uint64_t m_BlocksLayer0;
-    static constexpr size_t BitmapUnit = sizeof(m_Bitmap[0]) * 8;
+    uint64_t m_LayerIndex[LayerCount + 1];   // index of first bitmap unit of every layer
+
+#if BUDDY_RUN_INDEX
+    BuddyRunNode* m_RunTree;                // heap ordered, the leaves are the top level blocks
+    uint64_t m_RunTreeLeaves;
+#endif
+    uint64_t m_RunTreeSize;
 
     uint64_t m_LastAllocatedBlock;
     uint64_t m_LastAllocatedCount;
@@ -74,3 +112,69 @@ private:
 
     uint64_t m_Waste;
 };
+
+
+struct BuddyFreeNode
+{
+    BuddyFreeNode* Next;
+    BuddyFreeNode* Prev;
+};
+
+/**
+ * Buddy allocator which also keeps a free list for every layer, so finding a free block
+ * takes constant time instead of scanning the bitmaps. The list nodes are stored
+ * inside the free blocks themselves.
+ *
+ * A list contains exactly the blocks which are free, but whose parent is not
+ * (the biggest free blocks), and is kept in sync with the bitmaps by MarkBlocks.
+ */
+template<int TLayerCount = 10, bool TExactSize = false>
+class BasicBuddyAllocatorFreeList : public BasicBuddyAllocator<TLayerCount, TExactSize>
+{
+    typedef BasicBuddyAllocator<TLayerCount, TExactSize> Base;
+
+public:
+    BasicBuddyAllocatorFreeList();
+
+protected:
+    bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override;
+    uint64_t FindFreeBlock(int& layer) override;
+    void MarkBlocks(uint64_t block, size_t count, bool isUsed) override;
+
+private:
+    // calls 'callback(layer, index)' for every list entry which can be affected by marking the given blocks;
+    // if 'rangeUsed' is set, all the given blocks are used, so the blocks below them aren't visited
+    template<typename TCallback>
+    void ForEachFreeBlock(uint64_t block, size_t count, bool rangeUsed, TCallback callback);
+
+    template<typename TCallback>
+    void ForEachFreeBlock(int layer, uint64_t index, uint64_t first, uint64_t last, bool rangeUsed, TCallback callback);
+
+    void LinkBlock(int layer, uint64_t index);
+    void UnlinkBlock(int layer, uint64_t index);
+
+    inline BuddyFreeNode* ToNode(int layer, uint64_t index)
+    {
+        return reinterpret_cast<BuddyFreeNode*>(this->ToPtr(index << (TLayerCount - 1 - layer)));
+    }
+
+    BuddyFreeNode* m_FreeLists[TLayerCount];
+    bool m_FreeListsReady;
+};
+
+
+// 4 KB blocks: up to 2 MB
+using BuddyAllocator = BasicBuddyAllocator<>;
+using BuddyAllocatorFreeList = BasicBuddyAllocatorFreeList<>;
+
+// 4 KB blocks: up to 64 KB
+using BuddyAllocator64K = BasicBuddyAllocator<5>;
+using BuddyAllocatorFreeList64K = BasicBuddyAllocatorFreeList<5>;
+
+// 4 KB blocks: up to 1 GB
+using BuddyAllocator1G = BasicBuddyAllocator<19>;
+using BuddyAllocatorFreeList1G = BasicBuddyAllocatorFreeList<19>;
+
+// 4 KB blocks: up to 2 MB, without rounding up allocations
+using BuddyAllocatorExact = BasicBuddyAllocator<10, true>;
+using BuddyAllocatorFreeListExact = BasicBuddyAllocatorFreeList<10, true>;
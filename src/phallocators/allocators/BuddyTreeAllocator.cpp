@@ -0,0 +1,242 @@
+#include "BuddyTreeAllocator.hpp"
+#include <math/MathHelpers.hpp>
+#include <util/JsonWriter.hpp>
+#include <Debug.hpp>
+#include <memory.h>
+#include <sstream>
+
+BuddyTreeAllocator::BuddyTreeAllocator()
+    : Allocator(),
+      m_Tree(nullptr),
+      m_TreeSize(0),
+      m_Leaves(0),
+      m_RootOrder(0),
+      m_Waste(0)
+{
+}
+
+bool BuddyTreeAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
+{
+    m_Leaves = RoundToPowerOf2(m_MemSize);
+    m_RootOrder = CountTrailingZeros(m_Leaves);
+    m_TreeSize = 2 * m_Leaves * sizeof(NodeType);
+
+    // Find free region to fit the tree
+    RegionBlocks *freeRegion = nullptr;
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type == RegionType::Free && regions[i].Size * m_BlockSize >= m_TreeSize)
+            freeRegion = &regions[i];
+    }
+
+    // no free space :(
+    if (freeRegion == nullptr)
+    {
+        Debug::Error("BuddyTreeAllocator", "Not enough free memory - needed %u!", m_TreeSize);
+        return false;
+    }
+
+    m_Tree = reinterpret_cast<NodeType*>(ToPtr(freeRegion->Base));
+
+    // initialize tree with everything marked as "used"
+    memset(m_Tree, 0, m_TreeSize);
+
+    // process free regions first
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type == RegionType::Free)
+            MarkLeaves(regions[i].Base, regions[i].Size, false);
+    }
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type != RegionType::Free)
+            MarkLeaves(regions[i].Base, regions[i].Size, true);
+    }
+
+    // mark region used by tree as used
+    MarkLeaves(ToBlock(m_Tree), DivRoundUp(m_TreeSize, m_BlockSize), true);
+
+    RebuildTree();
+    return true;
+}
+
+ptr_t BuddyTreeAllocator::Allocate(uint32_t blocks)
+{
+    if (blocks == 0)
+        return nullptr;
+
+    int order = GetOrder(blocks);
+    if (order > MaxOrder)
+        return AllocateRun(blocks);
+
+    if (order > m_RootOrder || m_Tree[1] < order + 1)
+        return nullptr;
+
+    // go down to a node of the right order, always taking the first child which fits
+    uint64_t node = 1;
+    for (int nodeOrder = m_RootOrder; nodeOrder > order; nodeOrder--)
+    {
+        // entirely free node, the children might be out of date
+        if (m_Tree[node] == nodeOrder + 1)
+        {
+            m_Tree[node * 2] = nodeOrder;
+            m_Tree[node * 2 + 1] = nodeOrder;
+        }
+
+        node = (m_Tree[node * 2] >= order + 1) ? node * 2 : node * 2 + 1;
+    }
+
+    m_Tree[node] = 0;
+    UpdateParents(node, node, order);
+
+#ifdef MEASURE_WASTE
+    m_Waste += (1ull << order) - blocks;
+#endif
+
+    return ToPtr((node << order) - m_Leaves);
+}
+
+ptr_t BuddyTreeAllocator::AllocateRun(uint32_t blocks)
+{
+    if (MaxOrder > m_RootOrder)
+        return nullptr;
+
+    // the nodes of order MaxOrder are never out of date, because nothing bigger is ever
+    // allocated as a whole, so we can look for a run of entirely free nodes
+    uint64_t count = DivRoundUp<uint64_t>(blocks, 1ull << MaxOrder);
+    uint64_t layerStart = m_Leaves >> MaxOrder;
+    uint64_t runSize = 0;
+
+    for (uint64_t node = layerStart; node < layerStart * 2; node++)
+    {
+        if (m_Tree[node] != MaxOrder + 1)
+        {
+            runSize = 0;
+            continue;
+        }
+
+        if (++runSize == count)
+        {
+            uint64_t first = node + 1 - count;
+            memset(m_Tree + first, 0, count * sizeof(NodeType));
+            UpdateParents(first, node, MaxOrder);
+
+#ifdef MEASURE_WASTE
+            m_Waste += (count << MaxOrder) - blocks;
+#endif
+
+            return ToPtr((first - layerStart) << MaxOrder);
+        }
+    }
+
+    // nothing found
+    return nullptr;
+}
+
+void BuddyTreeAllocator::Free(ptr_t base, uint32_t blocks)
+{
+    int order = GetOrder(blocks);
+
+    // run of nodes of order MaxOrder
+    if (order > MaxOrder)
+    {
+        uint64_t count = DivRoundUp<uint64_t>(blocks, 1ull << MaxOrder);
+        uint64_t first = (m_Leaves + ToBlock(base)) >> MaxOrder;
+
+        memset(m_Tree + first, MaxOrder + 1, count * sizeof(NodeType));
+        UpdateParents(first, first + count - 1, MaxOrder);
+
+#ifdef MEASURE_WASTE
+        m_Waste -= (count << MaxOrder) - blocks;
+#endif
+        return;
+    }
+
+    uint64_t node = (m_Leaves + ToBlock(base)) >> order;
+    m_Tree[node] = order + 1;
+    UpdateParents(node, node, order);
+
+#ifdef MEASURE_WASTE
+    m_Waste -= (1ull << order) - blocks;
+#endif
+}
+
+void BuddyTreeAllocator::MarkLeaves(uint64_t base, uint64_t count, bool isUsed)
+{
+    memset(m_Tree + m_Leaves + base, isUsed ? 0 : 1, count * sizeof(NodeType));
+}
+
+void BuddyTreeAllocator::RebuildTree()
+{
+    uint64_t layerStart = m_Leaves / 2;
+    for (int order = 1; order <= m_RootOrder; order++, layerStart /= 2)
+    {
+        for (uint64_t node = layerStart; node < layerStart * 2; node++)
+            m_Tree[node] = Combine(m_Tree[node * 2], m_Tree[node * 2 + 1], order);
+    }
+}
+
+void BuddyTreeAllocator::UpdateParents(uint64_t first, uint64_t last, int order)
+{
+    for (first /= 2, last /= 2, order++; first > 0; first /= 2, last /= 2, order++)
+    {
+        for (uint64_t node = first; node <= last; node++)
+            m_Tree[node] = Combine(m_Tree[node * 2], m_Tree[node * 2 + 1], order);
+    }
+}
+
+
+// for statistics
+RegionType BuddyTreeAllocator::GetState(ptr_t address)
+{
+    if (address >= m_Tree && address < reinterpret_cast<uint8_t*>(m_Tree) + m_TreeSize)
+        return RegionType::Allocator;
+
+    uint64_t block = ToBlock(address);
+    if (block >= m_MemSize)
+        return RegionType::Unmapped;
+
+    // go down until we find a node which is either entirely free or entirely used
+    uint64_t node = 1;
+    for (int order = m_RootOrder; order > 0; order--)
+    {
+        if (m_Tree[node] == order + 1)
+            return RegionType::Free;
+        if (m_Tree[node] == 0)
+            return RegionType::Reserved;
+
+        node = node * 2 + ((block >> (order - 1)) & 1);
+    }
+
+    return (m_Tree[node] != 0) ? RegionType::Free : RegionType::Reserved;
+}
+
+void BuddyTreeAllocator::DumpImpl(JsonWriter& writer)
+{
+    writer.Property("treeSize", m_TreeSize);
+    writer.Property("leaves", m_Leaves);
+    writer.Property("rootOrder", m_RootOrder);
+
+    writer.BeginObject("tree");
+
+    uint64_t layerStart = 1;
+    for (int order = m_RootOrder; order >= 0; order--, layerStart *= 2)
+    {
+        std::stringstream layer;
+        for (uint64_t node = layerStart; node < layerStart * 2; node++)
+        {
+            if (node != layerStart)
+                layer << ",";
+            layer << static_cast<int>(m_Tree[node]);
+        }
+
+        writer.Property(std::to_string(m_RootOrder - order), layer.str());
+    }
+
+    writer.EndObject();
+}
+
+uint64_t BuddyTreeAllocator::MeasureWastedMemory()
+{
+    return DivRoundUp(sizeof(*this) + m_TreeSize, m_BlockSize) + m_Waste;
+}
@@ -0,0 +1,66 @@
+#include "Allocator.hpp"
+#include "../math/MathHelpers.hpp"
+
+/**
+ * Buddy allocator which uses a single complete binary tree over the whole memory.
+ * Every node stores the order of the largest free block in its subtree (plus 1, so
+ * 0 means there is nothing free), in 1 byte.
+ *
+ * Allocating is a single descent from the root to a node of the right order, freeing
+ * is a single update from that node up to the root.
+ *
+ * When a node is allocated or freed as a whole, the nodes below it are not updated;
+ * they are reset when a smaller block is split from it.
+ *
+ * Same as in BuddyAllocator, allocations bigger than 2^MaxOrder blocks are not rounded up
+ * to a power of 2, but use a run of free nodes of order MaxOrder.
+ */
+class BuddyTreeAllocator : public Allocator
+{
+public:
+    static constexpr int MaxOrder = 9;
+
+    BuddyTreeAllocator();
+    ptr_t Allocate(uint32_t blocks = 1) override;
+    void Free(ptr_t base, uint32_t blocks) override;
+
+    // for statistics
+    RegionType GetState(ptr_t address) override;
+    uint64_t MeasureWastedMemory() override;
+
+protected:
+    bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override;
+    void DumpImpl(JsonWriter& writer) override;
+
+    // sets the leaves [base, base + count); the tree needs to be rebuilt afterwards
+    void MarkLeaves(uint64_t base, uint64_t count, bool isUsed);
+    void RebuildTree();
+
+    ptr_t AllocateRun(uint32_t blocks);
+
+    // recalculates the parents of the nodes [first, last] of the given order, all the way up to the root
+    void UpdateParents(uint64_t first, uint64_t last, int order);
+
+    static inline int GetOrder(uint32_t blocks)
+    {
+        return Log2(blocks) + (IsPowerOf2(blocks) ? 0 : 1);
+    }
+
+    inline uint8_t Combine(uint8_t left, uint8_t right, int order)
+    {
+        // both children entirely free, so the parent is entirely free
+        if (left == order && right == order)
+            return order + 1;
+
+        return (left > right) ? left : right;
+    }
+
+    typedef uint8_t NodeType;
+
+    NodeType* m_Tree;           // heap ordered, root is at index 1
+    uint64_t m_TreeSize;        // in bytes
+    uint64_t m_Leaves;          // number of leaves, power of 2
+    int m_RootOrder;
+
+    uint64_t m_Waste;
+};
@@ -0,0 +1,456 @@
+#include "CompactLinkedListAllocator.hpp"
+#include <memory.h>
+#include <cassert>
+#include <math/MathHelpers.hpp>
+#include <util/JsonWriter.hpp>
+#include <Debug.hpp>
+
+void CompactRegion::Set(uint64_t base, uint64_t size, RegionType type)
+{
+    this->Base = static_cast<uint32_t>(base);
+    this->SizeAndType = static_cast<uint32_t>(size << TypeBits) | static_cast<uint32_t>(type);
+    this->Next = COMPACT_NULL_INDEX;
+    this->Prev = COMPACT_NULL_INDEX;
+}
+
+CompactLinkedListAllocator::CompactLinkedListAllocator()
+    : Allocator(),
+      m_First(COMPACT_NULL_INDEX),
+      m_Last(COMPACT_NULL_INDEX),
+      m_FirstFree(COMPACT_NULL_INDEX),
+      m_PoolCapacity(0),
+      m_PoolUsedElements(0),
+      m_PoolShift(0),
+      m_PoolCount(0),
+      m_PoolDirectorySize(0),
+      m_PoolDirectory(0),
+      m_FreeElements(COMPACT_NULL_INDEX),
+      m_StaticRegionPool()
+{
+    memset(m_StaticRegionPool, 0, sizeof(m_StaticRegionPool));
+}
+
+bool CompactLinkedListAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
+{
+    // block numbers have to fit in 32 bits
+    if (m_BlockSize < sizeof(CompactRegion) || m_MemSize > 0xFFFFFFFFull)
+        return false;
+
+    m_First = m_Last = COMPACT_NULL_INDEX;
+    m_FirstFree = COMPACT_NULL_INDEX;
+    m_FreeElements = COMPACT_NULL_INDEX;
+
+    // a pool is a power of 2 elements, so an index can be split with a shift
+    m_PoolShift = 63 - __builtin_clzll(m_BlockSize / sizeof(CompactRegion));
+    uint64_t poolSize = 1ull << m_PoolShift;
+    uint64_t staticSize = (poolSize < COMPACT_STATIC_POOL_SIZE) ? poolSize : COMPACT_STATIC_POOL_SIZE;
+
+    // every region is at least 1 block, so there can't be more pools than this
+    uint64_t directorySize = DivRoundUp<uint64_t>(m_MemSize, poolSize) + 1;
+    if (directorySize > (COMPACT_NULL_INDEX >> m_PoolShift))
+        directorySize = COMPACT_NULL_INDEX >> m_PoolShift;
+    uint64_t directoryBlocks = DivRoundUp<uint64_t>(directorySize * sizeof(uint32_t), m_BlockSize);
+
+    // nodes needed for the memory map (regions bigger than MaxSize take more than 1), plus 1
+    // for splitting the free region the directory is taken from; the pools which don't fit in
+    // the static pool are placed right after the directory
+    uint64_t nodes = 1;
+    for (size_t i = 0; i < regionCount; i++)
+        nodes += DivRoundUp<uint64_t>(regions[i].Size, CompactRegion::MaxSize);
+
+    uint64_t initialPools = (nodes > staticSize) ? DivRoundUp<uint64_t>(nodes - staticSize, poolSize) : 0;
+    uint64_t reservedBlocks = directoryBlocks + initialPools;
+
+    RegionBlocks* freeRegion = nullptr;
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type == RegionType::Free && regions[i].Size >= reservedBlocks)
+            freeRegion = &regions[i];
+    }
+
+    // without a directory, the allocator can still work with the static pool, it just can't grow
+    if (freeRegion == nullptr && initialPools > 0)
+    {
+        Debug::Error("CompactLinkedListAllocator", "Not enough free memory - needed %u blocks!", reservedBlocks);
+        return false;
+    }
+
+    m_PoolCount = 1;
+    m_PoolCapacity = staticSize;
+    m_PoolUsedElements = 0;
+    AddPoolElements(0, staticSize);
+
+    m_PoolDirectorySize = 1;
+    if (freeRegion != nullptr)
+    {
+        m_PoolDirectory = freeRegion->Base;
+        m_PoolDirectorySize = static_cast<uint32_t>(directorySize);
+
+        for (uint64_t i = 0; i < initialPools; i++)
+            AddPool(freeRegion->Base + directoryBlocks + i);
+    }
+
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (&regions[i] == freeRegion)
+        {
+            AddRegion(regions[i].Base, reservedBlocks, RegionType::Allocator);
+            AddRegion(regions[i].Base + reservedBlocks, regions[i].Size - reservedBlocks, RegionType::Free);
+        }
+        else AddRegion(regions[i].Base, regions[i].Size, regions[i].Type);
+    }
+
+    // the list is sorted by now
+    m_FirstFree = m_First;
+    while (m_FirstFree != COMPACT_NULL_INDEX && Get(m_FirstFree)->Type() != RegionType::Free)
+        m_FirstFree = Get(m_FirstFree)->Next;
+
+    return true;
+}
+
+void CompactLinkedListAllocator::AddRegion(uint64_t base, uint64_t size, RegionType type)
+{
+    // sizes have to fit in the packed field
+    while (size > 0)
+    {
+        uint64_t chunk = (size < CompactRegion::MaxSize) ? size : CompactRegion::MaxSize;
+
+        uint32_t index = NewRegion();
+        Get(index)->Set(base, chunk, type);
+
+        uint32_t insertPos = m_First;
+        while (insertPos != COMPACT_NULL_INDEX && base > Get(insertPos)->Base)
+            insertPos = Get(insertPos)->Next;
+
+        InsertRegion(index, insertPos);
+
+        base += chunk;
+        size -= chunk;
+    }
+}
+
+ptr_t CompactLinkedListAllocator::Allocate(uint32_t blocks)
+{
+    ptr_t ret = AllocateInternal(blocks, RegionType::Reserved);
+
+    // over 80% usage => add another block pool
+    if (m_PoolUsedElements >= (m_PoolCapacity * 4) / 5)
+        GrowPool();
+
+    return ret;
+}
+
+ptr_t CompactLinkedListAllocator::AllocateInternal(uint32_t blocks, RegionType type)
+{
+    if (blocks == 0)
+        return nullptr;
+
+    uint32_t found = FindFreeRegion(blocks);
+
+    // out of memory?
+    if (found == COMPACT_NULL_INDEX)
+        return nullptr;
+
+    CompactRegion* region = Get(found);
+    ptr_t ret = ToPtr(region->Base);
+
+    // splitting the region needs a free element
+    if (region->Size() != blocks && m_FreeElements == COMPACT_NULL_INDEX)
+        return nullptr;
+
+    // create reserved block
+    if (region->Size() == blocks)
+    {
+        region->SetType(type);
+
+        // the first free region is gone, the next one is somewhere after it
+        if (found == m_FirstFree)
+        {
+            while (m_FirstFree != COMPACT_NULL_INDEX && Get(m_FirstFree)->Type() != RegionType::Free)
+                m_FirstFree = Get(m_FirstFree)->Next;
+        }
+    }
+    else
+    {
+        uint32_t newRegion = NewRegion();
+        Get(newRegion)->Set(region->Base, blocks, type);
+        InsertRegion(newRegion, found);
+
+        region->Base += blocks;
+        region->SetSize(region->Size() - blocks);
+    }
+
+    return ret;
+}
+
+void CompactLinkedListAllocator::Free(ptr_t basePtr, uint32_t blocks)
+{
+    uint64_t base = ToBlock(basePtr);
+    uint32_t index = FindRegion(base);
+    if (index == COMPACT_NULL_INDEX)
+        return; // not found
+
+    CompactRegion* current = Get(index);
+    if (current->Type() == RegionType::Free)
+        return; // region is already free
+
+    current->SetType(RegionType::Free);
+
+    // freed before the first free region => it becomes the first free region, after merging
+    bool firstFree = (m_FirstFree == COMPACT_NULL_INDEX || base < Get(m_FirstFree)->Base);
+
+    // can we merge with the previous region?
+    if (current->Prev != COMPACT_NULL_INDEX)
+    {
+        CompactRegion* prev = Get(current->Prev);
+        if (prev->Type() == RegionType::Free && prev->Size() + current->Size() <= CompactRegion::MaxSize)
+        {
+            prev->SetSize(prev->Size() + current->Size());
+            index = current->Prev;
+            DeleteAndReleaseRegion(prev->Next);
+            current = prev;
+        }
+    }
+
+    // can we merge with the next region
+    if (current->Next != COMPACT_NULL_INDEX)
+    {
+        CompactRegion* next = Get(current->Next);
+        if (next->Type() == RegionType::Free && current->Size() + next->Size() <= CompactRegion::MaxSize)
+        {
+            current->SetSize(current->Size() + next->Size());
+            DeleteAndReleaseRegion(current->Next);
+        }
+    }
+
+    if (firstFree)
+        m_FirstFree = index;
+}
+
+uint32_t CompactLinkedListAllocator::NewRegion()
+{
+    assert(m_FreeElements != COMPACT_NULL_INDEX);
+
+    uint32_t index = m_FreeElements;
+    m_FreeElements = Get(index)->Next;
+
+    ++m_PoolUsedElements;
+    return index;
+}
+
+void CompactLinkedListAllocator::ReleaseRegion(uint32_t index)
+{
+    Get(index)->Next = m_FreeElements;
+    m_FreeElements = index;
+    m_PoolUsedElements--;
+}
+
+void CompactLinkedListAllocator::GrowPool()
+{
+    if (m_PoolCount >= m_PoolDirectorySize)
+        return;
+
+    // allocate another pool
+    ptr_t pool = AllocateInternal(1, RegionType::Allocator);
+    if (pool == nullptr)
+        return;
+
+    AddPool(ToBlock(pool));
+}
+
+void CompactLinkedListAllocator::AddPool(uint64_t block)
+{
+    auto* directory = reinterpret_cast<uint32_t*>(ToPtr(m_PoolDirectory));
+    directory[m_PoolCount] = static_cast<uint32_t>(block);
+
+    AddPoolElements(m_PoolCount, 1u << m_PoolShift);
+    m_PoolCapacity += 1u << m_PoolShift;
+    m_PoolCount++;
+}
+
+void CompactLinkedListAllocator::AddPoolElements(uint32_t pool, uint32_t count)
+{
+    // add in reverse, so the elements are handed out in order
+    for (uint32_t i = count; i > 0; i--)
+    {
+        uint32_t index = (pool << m_PoolShift) | (i - 1);
+        Get(index)->Next = m_FreeElements;
+        m_FreeElements = index;
+    }
+}
+
+uint32_t CompactLinkedListAllocator::FindRegion(uint64_t base)
+{
+    // regions are only found by their first block
+    if (m_First == COMPACT_NULL_INDEX || base < Get(m_First)->Base || base > Get(m_Last)->Base)
+        return COMPACT_NULL_INDEX;
+
+    // walk from the end which is closer by address
+    if (base - Get(m_First)->Base > Get(m_Last)->Base - base)
+    {
+        uint32_t current = m_Last;
+        while (current != COMPACT_NULL_INDEX)
+        {
+            CompactRegion* region = Get(current);
+            if (base >= region->Base)
+                return (base == region->Base) ? current : COMPACT_NULL_INDEX;
+
+            current = region->Prev;
+        }
+    }
+    else
+    {
+        uint32_t current = m_First;
+        while (current != COMPACT_NULL_INDEX)
+        {
+            CompactRegion* region = Get(current);
+            if (base <= region->Base)
+                return (base == region->Base) ? current : COMPACT_NULL_INDEX;
+
+            current = region->Next;
+        }
+    }
+
+    return COMPACT_NULL_INDEX;
+}
+
+void CompactLinkedListAllocator::InsertRegion(uint32_t index, uint32_t insertBefore)
+{
+    CompactRegion* region = Get(index);
+
+    // First region in list
+    if (m_First == COMPACT_NULL_INDEX)
+    {
+        m_First = m_Last = index;
+        region->Next = COMPACT_NULL_INDEX;
+        region->Prev = COMPACT_NULL_INDEX;
+    }
+    // last
+    else if (insertBefore == COMPACT_NULL_INDEX)
+    {
+        region->Prev = m_Last;
+        region->Next = COMPACT_NULL_INDEX;
+        Get(m_Last)->Next = index;
+        m_Last = index;
+    }
+    // first or middle
+    else
+    {
+        CompactRegion* before = Get(insertBefore);
+        region->Prev = before->Prev;
+        region->Next = insertBefore;
+
+        if (before->Prev == COMPACT_NULL_INDEX)
+            m_First = index;
+        else
+            Get(before->Prev)->Next = index;
+
+        before->Prev = index;
+    }
+}
+
+void CompactLinkedListAllocator::DeleteRegion(uint32_t index)
+{
+    CompactRegion* region = Get(index);
+
+    // first?
+    if (region->Prev == COMPACT_NULL_INDEX)
+        m_First = region->Next;
+    else
+        Get(region->Prev)->Next = region->Next;
+
+    // last?
+    if (region->Next == COMPACT_NULL_INDEX)
+        m_Last = region->Prev;
+    else
+        Get(region->Next)->Prev = region->Prev;
+}
+
+void CompactLinkedListAllocator::DeleteAndReleaseRegion(uint32_t index)
+{
+    DeleteRegion(index);
+    ReleaseRegion(index);
+}
+
+// for statistics
+RegionType CompactLinkedListAllocator::GetState(ptr_t address)
+{
+    uint64_t block = ToBlock(address);
+
+    for (uint32_t current = m_First; current != COMPACT_NULL_INDEX; current = Get(current)->Next)
+    {
+        CompactRegion* region = Get(current);
+        if (block >= region->Base && block < region->Base + region->Size())
+            return region->Type();
+    }
+
+    return RegionType::Unmapped;
+}
+
+// for debugging
+void CompactLinkedListAllocator::DumpImpl(JsonWriter& writer)
+{
+    writer.Property("totalCapacity", m_PoolCapacity);
+    writer.Property("usedBlocks", m_PoolUsedElements);
+    writer.Property("poolCount", m_PoolCount);
+    writer.BeginArray("blockList");
+
+    for (uint32_t current = m_First; current != COMPACT_NULL_INDEX; current = Get(current)->Next)
+    {
+        CompactRegion* region = Get(current);
+        writer.BeginObject();
+        writer.Property("id", current);
+        writer.Property("prev", region->Prev);
+        writer.Property("next", region->Next);
+        writer.Property("base", region->Base);
+        writer.Property("size", region->Size());
+        writer.Property("type", static_cast<int>(region->Type()));
+        writer.EndObject();
+    }
+
+    writer.EndArray();
+}
+
+uint64_t CompactLinkedListAllocator::MeasureWastedMemory()
+{
+    uint64_t total = DivRoundUp(sizeof(*this), m_BlockSize);
+    for (uint32_t current = m_First; current != COMPACT_NULL_INDEX; current = Get(current)->Next)
+    {
+        CompactRegion* region = Get(current);
+        if (region->Type() == RegionType::Allocator)
+            total += region->Size();
+    }
+    return total;
+}
+
+uint32_t CompactLinkedListAllocatorFirstFit::FindFreeRegion(uint32_t blocks)
+{
+    for (uint32_t current = m_FirstFree; current != COMPACT_NULL_INDEX; current = Get(current)->Next)
+    {
+        CompactRegion* region = Get(current);
+        if (region->Type() == RegionType::Free && region->Size() >= blocks)
+            return current;
+    }
+
+    return COMPACT_NULL_INDEX;
+}
+
+uint32_t CompactLinkedListAllocatorBestFit::FindFreeRegion(uint32_t blocks)
+{
+    uint32_t found = COMPACT_NULL_INDEX;
+    uint64_t foundSize = 0;
+
+    for (uint32_t current = m_FirstFree; current != COMPACT_NULL_INDEX; current = Get(current)->Next)
+    {
+        CompactRegion* region = Get(current);
+        if (region->Type() == RegionType::Free
+            && region->Size() >= blocks
+            && (found == COMPACT_NULL_INDEX || region->Size() < foundSize))
+        {
+            found = current;
+            foundSize = region->Size();
+        }
+    }
+
+    return found;
+}
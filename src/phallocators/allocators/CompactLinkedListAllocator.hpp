@@ -0,0 +1,127 @@
+#pragma once
+#include "Allocator.hpp"
+#include "../Config.hpp"
+
+#define COMPACT_STATIC_POOL_SIZE 256
+#define COMPACT_NULL_INDEX 0xFFFFFFFFu
+
+/**
+ * Linked list node which uses 32 bit block numbers and 32 bit pool indices instead
+ * of 64 bit values and pointers, with the type packed in the low bits of the size.
+ * It takes 16 bytes instead of 48, and doesn't depend on where memory is mapped.
+ */
+struct CompactRegion
+{
+    static constexpr uint32_t TypeBits = 2;
+    static constexpr uint32_t TypeMask = (1u << TypeBits) - 1;
+    static constexpr uint64_t MaxSize = (1ull << (32 - TypeBits)) - 1;
+
+    uint32_t Base;
+    uint32_t SizeAndType;       // size << TypeBits | type
+    uint32_t Next;              // pool indices
+    uint32_t Prev;
+
+    inline uint64_t Size() const { return SizeAndType >> TypeBits; }
+    inline RegionType Type() const { return static_cast<RegionType>(SizeAndType & TypeMask); }
+
+    inline void SetSize(uint64_t size)
+    {
+        SizeAndType = static_cast<uint32_t>(size << TypeBits) | (SizeAndType & TypeMask);
+    }
+
+    inline void SetType(RegionType type)
+    {
+        SizeAndType = (SizeAndType & ~TypeMask) | static_cast<uint32_t>(type);
+    }
+
+    void Set(uint64_t base, uint64_t size, RegionType type);
+};
+
+static_assert(sizeof(CompactRegion) == 16, "CompactRegion should be 16 bytes");
+
+
+/**
+ * Linked list allocator using CompactRegion nodes. Every pool is a whole block of nodes
+ * (the first one is inside the allocator), and a node is referred to by its pool
+ * number and position in the pool. The block numbers of the pools are kept in a
+ * directory, allocated at initialization together with the pools needed for the
+ * initial memory map.
+ *
+ * Following an index takes a directory lookup, so every step through the list costs
+ * more than with pointers. To make up for it, searches start at the first free region,
+ * and Free walks the list from the end closer to the freed address.
+ */
+class CompactLinkedListAllocator : public Allocator
+{
+public:
+    CompactLinkedListAllocator();
+    ptr_t Allocate(uint32_t blocks = 1) override;
+    void Free(ptr_t base, uint32_t blocks) override;
+
+    // for statistics
+    RegionType GetState(ptr_t address) override;
+    uint64_t MeasureWastedMemory() override;
+
+protected:
+    bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override;
+    void DumpImpl(JsonWriter& writer) override;
+
+    virtual uint32_t FindFreeRegion(uint32_t blocks) = 0;
+
+    inline CompactRegion* Get(uint32_t index)
+    {
+        uint32_t pool = index >> m_PoolShift;
+        uint32_t element = index & ((1u << m_PoolShift) - 1);
+
+        if (pool == 0)
+            return &m_StaticRegionPool[element];
+
+        auto* directory = reinterpret_cast<uint32_t*>(ToPtr(m_PoolDirectory));
+        return reinterpret_cast<CompactRegion*>(ToPtr(directory[pool])) + element;
+    }
+
+    // Block pool management
+    uint32_t NewRegion();
+    void ReleaseRegion(uint32_t index);
+    void GrowPool();
+    void AddPool(uint64_t block);
+    void AddPoolElements(uint32_t pool, uint32_t count);
+
+    // Linked list operations
+    uint32_t FindRegion(uint64_t base);
+    void InsertRegion(uint32_t index, uint32_t insertBefore);
+    void DeleteRegion(uint32_t index);
+    void DeleteAndReleaseRegion(uint32_t index);
+
+private:
+    ptr_t AllocateInternal(uint32_t blocks, RegionType type);
+    void AddRegion(uint64_t base, uint64_t size, RegionType type);
+
+protected:
+    uint32_t m_First, m_Last;
+    uint32_t m_FirstFree;               // no free region comes before it; searches start here
+
+    uint64_t m_PoolCapacity;
+    uint64_t m_PoolUsedElements;
+    uint32_t m_PoolShift;               // log2 of the number of elements in a pool
+    uint32_t m_PoolCount;
+    uint32_t m_PoolDirectorySize;       // maximum number of pools
+    uint64_t m_PoolDirectory;           // block where the directory begins
+
+    uint32_t m_FreeElements;            // unused elements, linked through 'Next'
+    CompactRegion m_StaticRegionPool[COMPACT_STATIC_POOL_SIZE];
+};
+
+
+class CompactLinkedListAllocatorFirstFit : public CompactLinkedListAllocator
+{
+protected:
+    uint32_t FindFreeRegion(uint32_t blocks) override;
+};
+
+
+class CompactLinkedListAllocatorBestFit : public CompactLinkedListAllocator
+{
+protected:
+    uint32_t FindFreeRegion(uint32_t blocks) override;
+};
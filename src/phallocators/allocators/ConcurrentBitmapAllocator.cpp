@@ -0,0 +1,270 @@
+#include "ConcurrentBitmapAllocator.hpp"
+#include <math/MathHelpers.hpp>
+#include <math/BitScan.hpp>
+#include <util/JsonWriter.hpp>
+#include <util/ThreadIndex.hpp>
+#include <Debug.hpp>
+#include <memory.h>
+#include <sstream>
+#include <algorithm>
+
+#define INVALID_BLOCK                   ((uint64_t)-1)
+
+ConcurrentBitmapAllocator::ConcurrentBitmapAllocator()
+    : Allocator(),
+      m_Bitmap(nullptr),
+      m_BitmapSize(0),
+      m_UnitCount(0),
+      m_FullUnits(0),
+      m_StartHints(),
+      m_MultiUnitLock()
+{
+}
+
+bool ConcurrentBitmapAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
+{
+    m_UnitCount = DivRoundUp(m_MemSize, static_cast<uint64_t>(BlocksPerUnit));
+    m_BitmapSize = m_UnitCount * sizeof(BitmapUnitType);
+
+    // Find free region to fit BitmapSize
+    RegionBlocks *freeRegion = nullptr;
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type == RegionType::Free && regions[i].Size * m_BlockSize >= m_BitmapSize)
+            freeRegion = &regions[i];
+    }
+
+    // no free space :(
+    if (freeRegion == nullptr)
+    {
+        Debug::Error("ConcurrentBitmapAllocator", "Not enough free memory - needed %u!", m_BitmapSize);
+        return false;
+    }
+
+    m_Bitmap = reinterpret_cast<BitmapUnitType*>(ToPtr(freeRegion->Base));
+
+    // initialize bitmap with everything marked as "used", including the bits past the end of memory
+    memset(m_Bitmap, 0xFF, m_BitmapSize);
+
+    // initialization is single threaded, so the bitmap can be filled without atomics
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type == RegionType::Free)
+            FillBits(m_Bitmap, regions[i].Base, regions[i].Size, false);
+    }
+    for (size_t i = 0; i < regionCount; i++)
+    {
+        if (regions[i].Type != RegionType::Free)
+            FillBits(m_Bitmap, regions[i].Base, regions[i].Size, true);
+    }
+
+    // mark region used by bitmap
+    FillBits(m_Bitmap, freeRegion->Base, DivRoundUp(m_BitmapSize, m_BlockSize), true);
+
+    m_FullUnits = std::count(m_Bitmap, m_Bitmap + m_UnitCount, FullUnit);
+
+    // threads start out spread over the bitmap
+    for (size_t i = 0; i < CONCURRENT_BITMAP_HINT_SLOTS; i++)
+        m_StartHints[i].Unit = i * m_UnitCount / CONCURRENT_BITMAP_HINT_SLOTS;
+
+    return true;
+}
+
+ptr_t ConcurrentBitmapAllocator::Allocate(uint32_t blocks)
+{
+    if (blocks == 0)
+        return nullptr;
+
+    // everything is used, don't search
+    if (__atomic_load_n(&m_FullUnits, __ATOMIC_RELAXED) == m_UnitCount)
+        return nullptr;
+
+    if (blocks <= BlocksPerUnit)
+    {
+        // threads sharing a slot can overwrite each other's hint, it is only where the search starts
+        StartHint& hint = m_StartHints[CurrentThreadIndex() % CONCURRENT_BITMAP_HINT_SLOTS];
+        uint64_t found = AllocateInUnit(blocks, __atomic_load_n(&hint.Unit, __ATOMIC_RELAXED));
+        if (found != INVALID_BLOCK)
+        {
+            __atomic_store_n(&hint.Unit, found / BlocksPerUnit, __ATOMIC_RELAXED);
+            return ToPtr(found);
+        }
+
+        // a single block always fits inside a unit, so there is nothing left
+        if (blocks == 1)
+            return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_MultiUnitLock);
+    uint64_t found = AllocateMultiUnit(blocks);
+    return (found != INVALID_BLOCK) ? ToPtr(found) : nullptr;
+}
+
+uint64_t ConcurrentBitmapAllocator::AllocateInUnit(uint32_t blocks, uint64_t startUnit)
+{
+    for (uint64_t i = 0; i < m_UnitCount; i++)
+    {
+        uint64_t unit = (startUnit + i) % m_UnitCount;
+        BitmapUnitType used = __atomic_load_n(&m_Bitmap[unit], __ATOMIC_RELAXED);
+
+        while (used != FullUnit)
+        {
+            int index = FindSetBitRun(static_cast<BitmapUnitType>(~used), blocks);
+            if (index < 0)
+                break;
+
+            // on failure 'used' is reloaded, and the unit is searched again
+            BitmapUnitType claimed = used | UnitMask(index, blocks);
+            if (__atomic_compare_exchange_n(&m_Bitmap[unit], &used, claimed, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                if (claimed == FullUnit)
+                    __atomic_fetch_add(&m_FullUnits, 1, __ATOMIC_RELAXED);
+
+                return unit * BlocksPerUnit + index;
+            }
+        }
+    }
+
+    return INVALID_BLOCK;
+}
+
+uint64_t ConcurrentBitmapAllocator::AllocateMultiUnit(uint32_t blocks)
+{
+    // first fit; the free runs found are only a snapshot, so claiming them can still fail
+    uint64_t runStart, runSize;
+    for (uint64_t start = 0; FindFreeRun(start, blocks, runStart, runSize); )
+    {
+        if (runSize >= blocks)
+        {
+            uint64_t conflict;
+            if (TryClaimBlocks(runStart, blocks, conflict))
+                return runStart;
+
+            start = conflict + 1;
+        }
+        else start = runStart + runSize;
+    }
+
+    return INVALID_BLOCK;
+}
+
+bool ConcurrentBitmapAllocator::FindFreeRun(uint64_t start, uint64_t limit, uint64_t& runStart, uint64_t& runSize)
+{
+    if (start >= m_MemSize)
+        return false;
+
+    // find the first free block, ignoring the blocks before 'start' in the first unit
+    uint64_t unit = start / BlocksPerUnit;
+    BitmapUnitType used = LoadUnit(unit);
+    BitmapUnitType free = ~used & (FullUnit << (start % BlocksPerUnit));
+    while (free == 0)
+    {
+        if (++unit >= m_UnitCount)
+            return false;
+
+        used = LoadUnit(unit);
+        free = ~used;
+    }
+
+    runStart = unit * BlocksPerUnit + CountTrailingZeros(free);
+
+    // find the first used block after the start of the run, using the same snapshot of the first unit
+    uint64_t runEnd;
+    used &= FullUnit << (runStart % BlocksPerUnit);
+    while (true)
+    {
+        if (used != 0)
+        {
+            runEnd = unit * BlocksPerUnit + CountTrailingZeros(used);
+            break;
+        }
+
+        runEnd = (unit + 1) * BlocksPerUnit;
+        if (runEnd - runStart >= limit || ++unit >= m_UnitCount)
+            break;
+
+        used = LoadUnit(unit);
+    }
+
+    runSize = std::min(runEnd, m_MemSize) - runStart;
+    return true;
+}
+
+bool ConcurrentBitmapAllocator::TryClaimBlocks(uint64_t base, uint64_t size, uint64_t& conflict)
+{
+    for (uint64_t block = base; block < base + size; )
+    {
+        uint64_t unit = block / BlocksPerUnit;
+        uint64_t count = std::min(BlocksPerUnit - block % BlocksPerUnit, base + size - block);
+        BitmapUnitType mask = UnitMask(block % BlocksPerUnit, count);
+
+        BitmapUnitType used = __atomic_load_n(&m_Bitmap[unit], __ATOMIC_RELAXED);
+        do
+        {
+            // taken by another thread since the search, give back what was claimed so far
+            if ((used & mask) != 0)
+            {
+                conflict = unit * BlocksPerUnit + CountTrailingZeros(used & mask);
+                ReleaseBlocks(base, block - base);
+                return false;
+            }
+        } while (!__atomic_compare_exchange_n(&m_Bitmap[unit], &used, used | mask, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+        if ((used | mask) == FullUnit)
+            __atomic_fetch_add(&m_FullUnits, 1, __ATOMIC_RELAXED);
+
+        block += count;
+    }
+
+    return true;
+}
+
+void ConcurrentBitmapAllocator::ReleaseBlocks(uint64_t base, uint64_t size)
+{
+    for (uint64_t block = base; block < base + size; )
+    {
+        uint64_t unit = block / BlocksPerUnit;
+        uint64_t count = std::min(BlocksPerUnit - block % BlocksPerUnit, base + size - block);
+
+        BitmapUnitType used = __atomic_fetch_and(&m_Bitmap[unit], ~UnitMask(block % BlocksPerUnit, count), __ATOMIC_RELEASE);
+        if (used == FullUnit)
+            __atomic_fetch_sub(&m_FullUnits, 1, __ATOMIC_RELAXED);
+
+        block += count;
+    }
+}
+
+void ConcurrentBitmapAllocator::Free(ptr_t base, uint32_t blocks)
+{
+    ReleaseBlocks(ToBlock(base), blocks);
+}
+
+// for statistics
+RegionType ConcurrentBitmapAllocator::GetState(ptr_t address)
+{
+    if (address >= m_Bitmap && address < reinterpret_cast<uint8_t*>(m_Bitmap) + m_BitmapSize)
+        return RegionType::Allocator;
+
+    uint64_t block = ToBlock(address);
+    if (block >= m_MemSize)
+        return RegionType::Unmapped;
+
+    bool used = (LoadUnit(block / BlocksPerUnit) & UnitMask(block % BlocksPerUnit, 1)) != 0;
+    return used ? RegionType::Reserved : RegionType::Free;
+}
+
+void ConcurrentBitmapAllocator::DumpImpl(JsonWriter& writer)
+{
+    writer.Property("bitmapSize", m_BitmapSize);
+
+    std::stringstream bitmap;
+    for (size_t i = 0; i < m_MemSize; i++)
+        bitmap << static_cast<int>((LoadUnit(i / BlocksPerUnit) & UnitMask(i % BlocksPerUnit, 1)) != 0);
+
+    writer.Property("bitmap", bitmap.str());
+}
+
+uint64_t ConcurrentBitmapAllocator::MeasureWastedMemory()
+{
+    return DivRoundUp(sizeof(*this) + m_BitmapSize, m_BlockSize);
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "Allocator.hpp"
+#include "../Config.hpp"
+#include <mutex>
+
+#define CONCURRENT_BITMAP_HINT_SLOTS    64      // threads are spread over this many search hints
+
+/**
+ * Bitmap allocator which can be called from multiple threads at the same time.
+ *
+ * Runs which fit inside one bitmap unit are claimed with a compare and swap on that unit,
+ * without taking any lock. Every thread starts searching from the unit where its last
+ * allocation succeeded (kept per instance, in a slot picked by thread index), so threads
+ * mostly work on different units.
+ *
+ * A count of the full units lets Allocate fail without a search when the whole bitmap is
+ * used. There is no summary though: when some blocks are free, but not a run of the
+ * requested size, a failing allocation still reads every unit.
+ *
+ * Runs which span multiple units are claimed one unit at a time, under a lock which is
+ * only taken by other multi unit allocations. If a unit turns out to be taken in the
+ * meantime, the units claimed so far are released and the search continues after it.
+ *
+ * Free clears the bits with an atomic AND, and never takes the lock.
+ */
+class ConcurrentBitmapAllocator : public Allocator
+{
+public:
+    ConcurrentBitmapAllocator();
+    ptr_t Allocate(uint32_t blocks = 1) override;
+    void Free(ptr_t base, uint32_t blocks) override;
+
+    // for statistics
+    RegionType GetState(ptr_t address) override;
+    uint64_t MeasureWastedMemory() override;
+
+protected:
+    bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override;
+    void DumpImpl(JsonWriter& writer) override;
+
+    typedef uint64_t BitmapUnitType;
+    static constexpr size_t BlocksPerUnit = sizeof(BitmapUnitType) * 8;
+    static constexpr BitmapUnitType FullUnit = static_cast<BitmapUnitType>(-1);
+
+    // returns the bits [offset, offset + count) of a unit; count must not go past the unit
+    static inline BitmapUnitType UnitMask(uint64_t offset, uint64_t count)
+    {
+        BitmapUnitType bits = (count >= BlocksPerUnit) ? FullUnit : ((static_cast<BitmapUnitType>(1) << count) - 1);
+        return bits << offset;
+    }
+
+    inline BitmapUnitType LoadUnit(uint64_t unit)
+    {
+        return __atomic_load_n(&m_Bitmap[unit], __ATOMIC_ACQUIRE);
+    }
+
+    // claims a run of blocks inside a single unit, starting the search at 'startUnit'
+    uint64_t AllocateInUnit(uint32_t blocks, uint64_t startUnit);
+
+    // claims a run of blocks which may span units; only called with m_MultiUnitLock held
+    uint64_t AllocateMultiUnit(uint32_t blocks);
+
+    /**
+     * Finds the first run of free blocks which starts at or after 'start', measured until it
+     * reaches 'limit' blocks. Returns false if there are no more free blocks.
+     */
+    bool FindFreeRun(uint64_t start, uint64_t limit, uint64_t& runStart, uint64_t& runSize);
+
+    // sets the bits of [base, base + size), fails if one of them was already set
+    bool TryClaimBlocks(uint64_t base, uint64_t size, uint64_t& conflict);
+    void ReleaseBlocks(uint64_t base, uint64_t size);
+
+    // unit where the last allocation of the threads using this slot succeeded
+    struct alignas(64) StartHint
+    {
+        uint64_t Unit;
+    };
+
+    BitmapUnitType* m_Bitmap;
+    uint64_t m_BitmapSize;
+    uint64_t m_UnitCount;
+    uint64_t m_FullUnits;       // units with no free blocks; only changed with atomics
+
+    StartHint m_StartHints[CONCURRENT_BITMAP_HINT_SLOTS];
+
+    std::mutex m_MultiUnitLock;
+};
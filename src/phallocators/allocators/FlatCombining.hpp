@@ -0,0 +1,213 @@
+#pragma once
+#include "Allocator.hpp"
+#include "../util/ThreadIndex.hpp"
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <type_traits>
+
+#define FLAT_COMBINING_SLOTS    64      // most requests which can be waiting at the same time (up to 64)
+
+/**
+ * Flat combining wrapper, which makes any allocator usable from multiple threads.
+ *
+ * A thread which finds the lock taken publishes its Allocate or Free request in a slot,
+ * and then either waits for it to be done, or takes the lock and becomes the combiner.
+ * The combiner collects all the published requests and applies them to TAllocator as
+ * one batch, so the allocator's data structures stay in one core's cache instead of
+ * moving with the lock. Without contention, the request is done directly under the lock.
+ *
+ * In a batch, frees go first, sorted by address, and the allocations after them can reuse
+ * the memory. If TAllocator has a FreeSorted(bases, count), the frees are handed to it in
+ * one call: the linked list frees the whole batch in one walk, the BST looks for every
+ * region next to the previous one. Otherwise they are freed one by one.
+ */
+
+template<typename TAllocator, typename = void>
+struct HasFreeSorted : std::false_type {};
+
+template<typename TAllocator>
+struct HasFreeSorted<TAllocator, std::void_t<decltype(std::declval<TAllocator&>().FreeSorted(
+    std::declval<const ptr_t*>(), size_t()))>> : std::true_type {};
+
+template<typename TAllocator>
+class FlatCombining : public TAllocator
+{
+    static_assert(FLAT_COMBINING_SLOTS <= 64, "The pending slots have to fit in 64 bits!");
+
+public:
+    ptr_t Allocate(uint32_t blocks = 1) override
+    {
+        if (m_Lock.try_lock())
+        {
+            ptr_t ret = TAllocator::Allocate(blocks);
+            Combine();
+            m_Lock.unlock();
+            return ret;
+        }
+
+        Slot& slot = AcquireSlot();
+        slot.Type = RequestType::Allocate;
+        slot.Base = nullptr;
+        slot.Blocks = blocks;
+        Execute(slot);
+
+        ptr_t ret = slot.Base;
+        ReleaseSlot(slot);
+        return ret;
+    }
+
+    void Free(ptr_t base, uint32_t blocks) override
+    {
+        if (m_Lock.try_lock())
+        {
+            TAllocator::Free(base, blocks);
+            Combine();
+            m_Lock.unlock();
+            return;
+        }
+
+        Slot& slot = AcquireSlot();
+        slot.Type = RequestType::Free;
+        slot.Base = base;
+        slot.Blocks = blocks;
+        Execute(slot);
+        ReleaseSlot(slot);
+    }
+
+    void Maintain() override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        TAllocator::Maintain();
+    }
+
+    // for statistics
+    RegionType GetState(ptr_t address) override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        return TAllocator::GetState(address);
+    }
+
+    uint64_t MeasureWastedMemory() override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        return TAllocator::MeasureWastedMemory() + DivRoundUp<uint64_t>(sizeof(*this) - sizeof(TAllocator), this->m_BlockSize);
+    }
+
+private:
+    enum class RequestType
+    {
+        Allocate,
+        Free,
+    };
+
+    struct alignas(64) Slot
+    {
+        std::atomic<bool> Owned { false };
+        std::atomic<bool> Done { false };
+
+        // written by the owner before publishing, and by the combiner before marking it done
+        RequestType Type;
+        ptr_t Base;
+        uint32_t Blocks;
+    };
+
+    inline uint32_t SlotIndex(const Slot& slot) const
+    {
+        return static_cast<uint32_t>(&slot - m_Slots);
+    }
+
+    // a thread usually gets the slot of its thread index; if it's taken, the next free one
+    Slot& AcquireSlot()
+    {
+        for (uint32_t i = CurrentThreadIndex() % FLAT_COMBINING_SLOTS; ; i = (i + 1) % FLAT_COMBINING_SLOTS)
+        {
+            if (!m_Slots[i].Owned.load(std::memory_order_relaxed) && !m_Slots[i].Owned.exchange(true, std::memory_order_acquire))
+                return m_Slots[i];
+
+            // all the slots are taken
+            if (i == FLAT_COMBINING_SLOTS - 1)
+                std::this_thread::yield();
+        }
+    }
+
+    void ReleaseSlot(Slot& slot)
+    {
+        slot.Owned.store(false, std::memory_order_release);
+    }
+
+    void Execute(Slot& slot)
+    {
+        slot.Done.store(false, std::memory_order_relaxed);
+        m_Pending.fetch_or(1ull << SlotIndex(slot), std::memory_order_release);
+
+        while (!slot.Done.load(std::memory_order_acquire))
+        {
+            if (m_Lock.try_lock())
+            {
+                Combine();
+                m_Lock.unlock();
+            }
+            else std::this_thread::yield();
+        }
+    }
+
+    // called with the lock held
+    void Combine()
+    {
+        // usually nobody is waiting, so don't write to the shared word
+        if (m_Pending.load(std::memory_order_relaxed) == 0)
+            return;
+
+        uint64_t pending = m_Pending.exchange(0, std::memory_order_acquire);
+
+        uint32_t batch[FLAT_COMBINING_SLOTS];
+        uint32_t count = 0;
+
+        for (; pending != 0; pending &= pending - 1)
+            batch[count++] = CountTrailingZeros(pending);
+
+        // frees first, by address; the allocations stay in slot order
+        std::sort(batch, batch + count, [this](uint32_t a, uint32_t b)
+        {
+            const Slot& left = m_Slots[a];
+            const Slot& right = m_Slots[b];
+
+            if (left.Type != right.Type)
+                return left.Type == RequestType::Free;
+
+            if (left.Type == RequestType::Free && left.Base != right.Base)
+                return left.Base < right.Base;
+
+            return a < b;
+        });
+
+        uint32_t i = 0;
+        if constexpr (HasFreeSorted<TAllocator>::value)
+        {
+            ptr_t bases[FLAT_COMBINING_SLOTS];
+            for (; i < count && m_Slots[batch[i]].Type == RequestType::Free; i++)
+                bases[i] = m_Slots[batch[i]].Base;
+
+            TAllocator::FreeSorted(bases, i);
+            for (uint32_t j = 0; j < i; j++)
+                m_Slots[batch[j]].Done.store(true, std::memory_order_release);
+        }
+
+        for (; i < count; i++)
+        {
+            Slot& slot = m_Slots[batch[i]];
+            if (slot.Type == RequestType::Free)
+                TAllocator::Free(slot.Base, slot.Blocks);
+            else
+                slot.Base = TAllocator::Allocate(slot.Blocks);
+
+            slot.Done.store(true, std::memory_order_release);
+        }
+    }
+
+    std::mutex m_Lock;                          // held by the combiner
+    std::atomic<uint64_t> m_Pending { 0 };      // 1 bit for every published slot
+    Slot m_Slots[FLAT_COMBINING_SLOTS];
+};
@@ -1,6 +1,7 @@
 #include "LinkedListAllocator.hpp"
 #include <memory.h>
 #include <cassert>
+#include <algorithm>
 #include <math/MathHelpers.hpp>
 #include <util/JsonWriter.hpp>
 
@@ -29,21 +30,35 @@ LinkedListAllocator::LinkedListAllocator()
       m_Last(nullptr),
       m_PoolCapacity(STATIC_POOL_SIZE),
       m_PoolUsedElements(0),
+      m_PoolLowWatermark(0),
+      m_PoolHighWatermark(0),
       m_FirstPool(),
       m_StaticRegionPool(),
-      m_CurrentPool(&m_FirstPool),
-      m_CurrentPoolNextFree(0)
+      m_FreeElements(nullptr)
+#if LINKED_LIST_ADDRESS_INDEX
+      , m_Index(),
+      m_IndexEnabled(false),
+      m_IndexValid(false),
+      m_IndexChunks(nullptr),
+      m_IndexCapacity(0)
+#endif
 {
     memset(m_StaticRegionPool, 0, sizeof(m_StaticRegionPool));
     m_FirstPool.Elements = m_StaticRegionPool;
     m_FirstPool.Size = STATIC_POOL_SIZE;
     m_FirstPool.Next = &m_FirstPool;
+    AddPoolElements(&m_FirstPool);
 }
 
 bool LinkedListAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 {
     m_First = nullptr;
     m_Last = nullptr;
+#if LINKED_LIST_ADDRESS_INDEX
+    m_IndexValid = false;
+    m_IndexChunks = nullptr;
+    m_IndexCapacity = 0;
+#endif
 
     for (size_t i = 0; i < regionCount; i++)
     {
@@ -55,6 +70,17 @@ bool LinkedListAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCo
         InsertRegion(region, insertPos);
     }
 
+    for (auto current = m_First; current != nullptr; current = current->Next)
+    {
+        if (current->Type == RegionType::Free)
+            OnFreeRegionAdded(current);
+    }
+
+#if LINKED_LIST_ADDRESS_INDEX
+    if (m_IndexEnabled)
+        BuildIndex();
+#endif
+
     return true;
 }
 
@@ -62,9 +88,26 @@ ptr_t LinkedListAllocator::Allocate(uint32_t blocks)
 {
     ptr_t ret = AllocateInternal(blocks, RegionType::Reserved);
 
-    // over 80% usage => add another block pool
-    if (m_PoolUsedElements >= (m_PoolCapacity * 4) / 5)
-        GrowPool();
+    if (m_PoolLowWatermark == 0)
+    {
+        // over 80% usage => add another block pool
+        if (m_PoolUsedElements >= (m_PoolCapacity * 4) / 5)
+            GrowPool();
+    }
+    else
+    {
+        // Maintain() wasn't called in time
+        if (FreePoolElements() < POOL_RESERVE_ELEMENTS)
+            GrowPool();
+    }
+
+#if LINKED_LIST_ADDRESS_INDEX
+    // keep enough free index nodes for the next allocation and pool growth; with watermarks,
+    // only when Maintain() wasn't called in time
+    uint64_t indexReserve = (m_PoolLowWatermark == 0) ? IndexSpareNodes() : 2ull * m_Index.Levels();
+    if (m_IndexValid && m_Index.FreeNodes() < indexReserve)
+        GrowIndex(4ull * m_Index.Levels());
+#endif
 
     return ret;
 }
@@ -76,11 +119,12 @@ ptr_t LinkedListAllocator::AllocateInternal(uint32_t blocks, RegionType type)
 
     LinkedListRegion* found = FindFreeRegion(blocks);
 
-    // out of memory?
-    if (found == nullptr)
+    // out of memory? (splitting the region needs a free element)
+    if (found == nullptr || (found->Size != blocks && m_FreeElements == nullptr))
         return nullptr;
 
     ptr_t ret = ToPtr(found->Base);
+    OnFreeRegionRemoved(found);
 
     // create reserved block
     if (found->Size == blocks)
@@ -95,6 +139,10 @@ ptr_t LinkedListAllocator::AllocateInternal(uint32_t blocks, RegionType type)
 
         found->Base += blocks;
         found->Size -= blocks;
+#if LINKED_LIST_ADDRESS_INDEX
+        IndexRegion(found);
+#endif
+        OnFreeRegionAdded(found);
     }
 
     return ret;
@@ -102,13 +150,110 @@ ptr_t LinkedListAllocator::AllocateInternal(uint32_t blocks, RegionType type)
 
 void LinkedListAllocator::Free(void* basePtr, uint32_t blocks)
 {
-    uint64_t base = ToBlock(basePtr);
+    FreeInternal(ToBlock(basePtr));
+    ShrinkAfterFree();
+}
+
+void LinkedListAllocator::FreeSorted(const ptr_t bases[], size_t count)
+{
+    LinkedListRegion* current = m_First;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t base = ToBlock(bases[i]);
+
+#if LINKED_LIST_ADDRESS_INDEX
+        LinkedListRegion* found;
+        if (m_IndexValid && (found = FindRegion(base)) != nullptr)
+            current = found;
+        else
+#endif
+        {
+            // the bases are sorted, so carry on from the previous one
+            while (current != nullptr && current->Base < base)
+                current = current->Next;
+        }
+
+        if (current != nullptr && current->Base == base)
+            current = FreeRegion(current);
+    }
+
+    ShrinkAfterFree();
+}
+
+void LinkedListAllocator::ShrinkAfterFree()
+{
+#if LINKED_LIST_ADDRESS_INDEX
+    // the index ran out of nodes; freeing walks the list until it is rebuilt anyway
+    if (m_PoolLowWatermark == 0 && m_IndexEnabled && !m_IndexValid)
+        BuildIndex();
+    else if (m_PoolLowWatermark == 0)
+        ShrinkIndex();
+#endif
+
+    // under 20% usage => compact the elements and free up some pools
+    if (m_PoolLowWatermark == 0 && m_FirstPool.Next != &m_FirstPool && m_PoolUsedElements < m_PoolCapacity / 5)
+        ShrinkPool();
+}
+
+void LinkedListAllocator::Maintain()
+{
+#if LINKED_LIST_ADDRESS_INDEX
+    if (m_IndexEnabled && !m_IndexValid)
+        BuildIndex();
+    else if (m_IndexValid && m_PoolLowWatermark != 0 && m_Index.FreeNodes() < m_PoolLowWatermark)
+        GrowIndex(m_PoolHighWatermark - m_Index.FreeNodes());
+    else
+        ShrinkIndex();
+#endif
+
+    if (m_PoolLowWatermark == 0)
+        return;
+
+    if (FreePoolElements() < m_PoolLowWatermark)
+    {
+        while (FreePoolElements() < m_PoolHighWatermark)
+        {
+            // out of memory, try again next time
+            if (!GrowPool())
+                break;
+        }
+    }
+    else if (m_FirstPool.Next != &m_FirstPool && m_PoolUsedElements < m_PoolCapacity / 5)
+        ShrinkPool();
+}
+
+void LinkedListAllocator::SetPoolWatermarks(uint64_t low, uint64_t high)
+{
+    if (low != 0 && low < POOL_RESERVE_ELEMENTS)
+        low = POOL_RESERVE_ELEMENTS;
+
+    m_PoolLowWatermark = low;
+    m_PoolHighWatermark = (high > low) ? high : low;
+}
+
+void LinkedListAllocator::SetAddressIndex(bool enabled)
+{
+#if LINKED_LIST_ADDRESS_INDEX
+    m_IndexEnabled = enabled;
+    if (!enabled)
+        ReleaseIndex();
+#endif
+}
+
+void LinkedListAllocator::FreeInternal(uint64_t base)
+{
     LinkedListRegion* current = FindRegion(base);
 
-    if (current == nullptr
-        || current->Type == RegionType::Free
-        || current->Base != base)
-        return; // not found, or region is already free
+    if (current == nullptr || current->Base != base)
+        return; // not found
+
+    FreeRegion(current);
+}
+
+LinkedListRegion* LinkedListAllocator::FreeRegion(LinkedListRegion* current)
+{
+    if (current->Type == RegionType::Free)
+        return current; // region is already free
 
     current->Type = RegionType::Free;
 
@@ -116,6 +261,7 @@ void LinkedListAllocator::Free(void* basePtr, uint32_t blocks)
     if (current->Prev != nullptr && current->Prev->Type == RegionType::Free)
     {
         current = current->Prev;
+        OnFreeRegionRemoved(current);
         current->Size += current->Next->Size;
         DeleteAndReleaseRegion(current->Next);
     }
@@ -123,45 +269,41 @@ void LinkedListAllocator::Free(void* basePtr, uint32_t blocks)
     // can we merge with the next region
     if (current->Next != nullptr && current->Next->Type == RegionType::Free)
     {
+        OnFreeRegionRemoved(current->Next);
         current->Size += current->Next->Size;
         DeleteAndReleaseRegion(current->Next);
     }
 
-    // TODO: under 20% usage? compress and free up some pools
+    OnFreeRegionAdded(current);
+    return current;
 }
 
 LinkedListRegion* LinkedListAllocator::NewRegion()
 {
     assert(m_PoolUsedElements < m_PoolCapacity);
+    assert(m_FreeElements != nullptr);
 
-    do {
-        if (m_CurrentPoolNextFree >= m_CurrentPool->Size)
-        {
-            m_CurrentPool = m_CurrentPool->Next;
-            m_CurrentPoolNextFree = 0;
-        }
-        if (m_CurrentPool == nullptr)
-        {
-            m_CurrentPool = &m_FirstPool;
-            m_CurrentPoolNextFree = 0;
-        }
-
-    } while (m_CurrentPool->Elements[m_CurrentPoolNextFree++].ElementUsed);
+    LinkedListRegion* region = m_FreeElements;
+    m_FreeElements = region->Next;
 
     ++m_PoolUsedElements;
-    return &m_CurrentPool->Elements[m_CurrentPoolNextFree - 1];
+    return region;
 }
 
 void LinkedListAllocator::ReleaseRegion(LinkedListRegion* region)
 {
     region->Clear();
+    region->Next = m_FreeElements;
+    m_FreeElements = region;
     m_PoolUsedElements--;
 }
 
-void LinkedListAllocator::GrowPool()
+bool LinkedListAllocator::GrowPool()
 {
     // allocate another pool
     auto* u8NewPool = reinterpret_cast<uint8_t*>(AllocateInternal(1, RegionType::Allocator));
+    if (u8NewPool == nullptr)
+        return false;
 
     auto* newPool = reinterpret_cast<LinkedListRegionPool*>(u8NewPool);
     newPool->Elements = reinterpret_cast<LinkedListRegion*>(u8NewPool + sizeof(LinkedListRegionPool));
@@ -171,10 +313,198 @@ void LinkedListAllocator::GrowPool()
     newPool->Next = m_FirstPool.Next;
     m_FirstPool.Next = newPool;
     m_PoolCapacity += newPool->Size;
+    AddPoolElements(newPool);
+    return true;
+}
+
+void LinkedListAllocator::ShrinkPool()
+{
+    // take out pools, as long as the remaining ones stay under 50% usage
+    LinkedListRegionPool* released = nullptr;
+    LinkedListRegionPool* prev = &m_FirstPool;
+    while (prev->Next != &m_FirstPool)
+    {
+        LinkedListRegionPool* pool = prev->Next;
+        if (m_PoolCapacity - pool->Size < 2 * m_PoolUsedElements
+            || m_PoolCapacity - pool->Size < m_PoolUsedElements + m_PoolHighWatermark)
+        {
+            prev = pool;
+            continue;
+        }
+
+        prev->Next = pool->Next;
+        pool->Next = released;
+        released = pool;
+        m_PoolCapacity -= pool->Size;
+    }
+
+    if (released == nullptr)
+        return;
+
+    // only the unused elements of the remaining pools can be handed out
+    m_FreeElements = nullptr;
+    LinkedListRegionPool* pool = &m_FirstPool;
+    do {
+        for (uint64_t i = pool->Size; i > 0; i--)
+        {
+            if (!pool->Elements[i - 1].ElementUsed)
+            {
+                pool->Elements[i - 1].Next = m_FreeElements;
+                m_FreeElements = &pool->Elements[i - 1];
+            }
+        }
+        pool = pool->Next;
+    } while (pool != &m_FirstPool);
+
+    // move the elements still in use out of the released pools
+    for (pool = released; pool != nullptr; pool = pool->Next)
+    {
+        for (uint64_t i = 0; i < pool->Size; i++)
+        {
+            if (pool->Elements[i].ElementUsed)
+                MoveRegion(&pool->Elements[i]);
+        }
+    }
+
+    // give the pool blocks back
+    while (released != nullptr)
+    {
+        LinkedListRegionPool* next = released->Next;
+        FreeInternal(ToBlock(released));
+        released = next;
+    }
+}
+
+void LinkedListAllocator::MoveRegion(LinkedListRegion* region)
+{
+    bool free = (region->Type == RegionType::Free);
+    if (free)
+        OnFreeRegionRemoved(region);
+
+    LinkedListRegion* next = region->Next;
+    DeleteRegion(region);
+
+    LinkedListRegion* moved = NewRegion();
+    moved->Set(region->Base, region->Size, region->Type);
+    InsertRegion(moved, next);
+
+    // the old element is not put back in the free list, its pool is going away
+    region->Clear();
+    m_PoolUsedElements--;
+
+    if (free)
+        OnFreeRegionAdded(moved);
+}
+
+void LinkedListAllocator::AddPoolElements(LinkedListRegionPool* pool)
+{
+    // add in reverse, so the elements are handed out in order
+    for (uint64_t i = pool->Size; i > 0; i--)
+    {
+        pool->Elements[i - 1].Next = m_FreeElements;
+        m_FreeElements = &pool->Elements[i - 1];
+    }
+}
+
+#if LINKED_LIST_ADDRESS_INDEX
+bool LinkedListAllocator::BuildIndex()
+{
+    ReleaseIndex();
+
+    // one node for every distinct key prefix on every level of the tree; the list is
+    // sorted, so a prefix is new when it differs from the previous region's
+    uint64_t nodes = 0;
+    uint64_t prefixes[64 / RADIX_INDEX_BITS + 1];
+    for (auto current = m_First; current != nullptr; current = current->Next)
+    {
+        for (int level = 0; level < m_Index.Levels(); level++)
+        {
+            int shift = (level + 1) * RADIX_INDEX_BITS;
+            uint64_t prefix = (shift < 64) ? (current->Base >> shift) : 0;
+            if (current == m_First || prefix != prefixes[level])
+                nodes++;
+
+            prefixes[level] = prefix;
+        }
+    }
+
+    // spare nodes for the region holding the nodes, and the next few allocations
+    if (!GrowIndex(nodes + IndexSpareNodes()))
+        return false;
+
+    m_IndexValid = true;
+    for (auto current = m_First; current != nullptr; current = current->Next)
+        IndexRegion(current);
+
+    return m_IndexValid;
 }
 
+void LinkedListAllocator::ReleaseIndex()
+{
+    // the list is walked while the chunks are freed
+    m_IndexValid = false;
+    while (m_IndexChunks != nullptr)
+    {
+        LinkedListIndexChunk* chunk = m_IndexChunks;
+        m_IndexChunks = chunk->Next;
+        FreeInternal(ToBlock(chunk));
+    }
+
+    m_Index.Initialize(m_MemSize);
+    m_IndexCapacity = 0;
+}
+
+bool LinkedListAllocator::GrowIndex(uint64_t nodes)
+{
+    if (m_BlockSize < sizeof(LinkedListIndexChunk) + sizeof(RadixIndexNode))
+        return false;
+
+    // one chunk for all the nodes, or a block at a time if memory is too fragmented for that
+    uint64_t blocks = DivRoundUp<uint64_t>(sizeof(LinkedListIndexChunk) + nodes * sizeof(RadixIndexNode), m_BlockSize);
+    while (nodes > 0)
+    {
+        auto* chunk = reinterpret_cast<LinkedListIndexChunk*>(AllocateInternal(blocks, RegionType::Allocator));
+        if (chunk == nullptr)
+        {
+            if (blocks == 1)
+                return false;
+
+            blocks = 1;
+            continue;
+        }
+
+        chunk->Next = m_IndexChunks;
+        m_IndexChunks = chunk;
+
+        uint64_t bytes = blocks * m_BlockSize - sizeof(LinkedListIndexChunk);
+        m_Index.AddNodes(chunk + 1, bytes);
+        m_IndexCapacity += bytes / sizeof(RadixIndexNode);
+        nodes -= std::min<uint64_t>(nodes, bytes / sizeof(RadixIndexNode));
+    }
+
+    return true;
+}
+
+void LinkedListAllocator::ShrinkIndex()
+{
+    // Under 20% usage => rebuild the index in fresh chunks, which gives the emptied ones
+    // back. Nodes are scattered over the chunks, so compacting them means rebuilding.
+    // BuildIndex leaves up to IndexSpareNodes() and a block's worth of nodes free, so
+    // require more than that to avoid rebuilding again right away.
+    uint64_t free = m_Index.FreeNodes();
+    uint64_t rebuiltFree = IndexSpareNodes() + m_BlockSize / sizeof(RadixIndexNode);
+    if (m_IndexValid && m_IndexCapacity - free < m_IndexCapacity / 5 && free > 2 * rebuiltFree)
+        BuildIndex();
+}
+#endif
+
 LinkedListRegion* LinkedListAllocator::FindRegion(uint64_t base)
 {
+#if LINKED_LIST_ADDRESS_INDEX
+    if (m_IndexValid)
+        return reinterpret_cast<LinkedListRegion*>(m_Index.Find(base));
+#endif
+
     LinkedListRegion* current = m_First;
     while (current != nullptr && base > current->Base)
         current = current->Next;
@@ -187,6 +517,21 @@ LinkedListRegion* LinkedListAllocator::FindRegion(uint64_t base)
 
 LinkedListRegion* LinkedListAllocator::FindInsertionPosition(uint64_t base, size_t size)
 {
+#if LINKED_LIST_ADDRESS_INDEX
+    if (m_IndexValid)
+    {
+        // insert after the last region which starts before 'base'
+        auto* prev = reinterpret_cast<LinkedListRegion*>(m_Index.FindPredecessor(base));
+        if (prev == nullptr)
+            return m_First;
+
+        if (prev->Base == base && size <= prev->Size)
+            return prev;
+
+        return prev->Next;
+    }
+#endif
+
     LinkedListRegion* insertPos = m_First;
     while (insertPos != nullptr && (base > insertPos->Base || (base == insertPos->Base && size > insertPos->Size)))
         insertPos = insertPos->Next;
@@ -227,6 +572,10 @@ void LinkedListAllocator::InsertRegion(LinkedListRegion* region, LinkedListRegio
         insertBefore->Prev->Next = region;
         insertBefore->Prev = region;
     }
+
+#if LINKED_LIST_ADDRESS_INDEX
+    IndexRegion(region);
+#endif
 }
 
 void LinkedListAllocator::DeleteRegion(LinkedListRegion* region)
@@ -243,6 +592,10 @@ void LinkedListAllocator::DeleteRegion(LinkedListRegion* region)
     else
 	    region->Next->Prev = region->Prev;
 
+#if LINKED_LIST_ADDRESS_INDEX
+    if (m_IndexValid)
+        m_Index.Remove(region->Base);
+#endif
 }
 
 void LinkedListAllocator::DeleteAndReleaseRegion(LinkedListRegion* region)
@@ -255,6 +608,18 @@ void LinkedListAllocator::DeleteAndReleaseRegion(LinkedListRegion* region)
 RegionType LinkedListAllocator::GetState(ptr_t address)
 {
     uint64_t block = ToBlock(address);
+
+#if LINKED_LIST_ADDRESS_INDEX
+    if (m_IndexValid)
+    {
+        auto* region = reinterpret_cast<LinkedListRegion*>(m_Index.FindPredecessor(block));
+        if (region != nullptr && block < region->Base + region->Size)
+            return region->Type;
+
+        return RegionType::Unmapped;
+    }
+#endif
+
     for (auto current = m_First; current != nullptr; current = current->Next)
     {
         if (block >= current->Base && block < current->Base + current->Size)
@@ -269,6 +634,11 @@ void LinkedListAllocator::DumpImpl(JsonWriter& writer)
 {
     writer.Property("totalCapacity", m_PoolCapacity);
     writer.Property("usedBlocks", m_PoolUsedElements);
+#if LINKED_LIST_ADDRESS_INDEX
+    writer.Property("indexValid", m_IndexValid);
+    writer.Property("indexCapacity", m_IndexCapacity);
+    writer.Property("indexFreeNodes", m_Index.FreeNodes());
+#endif
     writer.BeginArray("blockList");
 
     for (auto current = m_First; current != nullptr; current = current->Next)
@@ -1,7 +1,13 @@
+#pragma once
 #include "Allocator.hpp"
+#include "../Config.hpp"
+#include "../util/RadixIndex.hpp"
 
 #define STATIC_POOL_SIZE 256
 
+// free elements always kept around for the allocator's own allocations
+#define POOL_RESERVE_ELEMENTS 4
+
 struct LinkedListRegion
 {
     uint64_t Base;
@@ -26,6 +32,12 @@ struct LinkedListRegionPool
     LinkedListRegion* Elements;
 };
 
+// Blocks holding address index nodes; the nodes follow the header
+struct LinkedListIndexChunk
+{
+    LinkedListIndexChunk* Next;
+};
+
 
 
 class LinkedListAllocator : public Allocator
@@ -34,6 +46,22 @@ public:
     LinkedListAllocator();
     ptr_t Allocate(uint32_t blocks = 1) override;
     void Free(void* base, uint32_t blocks) override;
+    void Maintain() override;
+
+    // Frees a batch of regions sorted by address, in one walk over the list (or with the
+    // address index, when there is one); regions freed next to each other merge as it goes.
+    void FreeSorted(const ptr_t bases[], size_t count);
+
+    // Pools are refilled in Maintain() when there are less than 'low' free elements, up to
+    // 'high' free elements; Allocate and Free don't grow or shrink them anymore, unless the
+    // pools are about to run out. The address index is refilled the same way, counting
+    // free index nodes. low = 0 goes back to growing and shrinking inline.
+    void SetPoolWatermarks(uint64_t low, uint64_t high);
+
+    // Keeps a radix tree of the regions by address, so Free and GetState don't walk the
+    // list; it costs up to one index node (~520 bytes) per region and tree level. Off by
+    // default; when turned on after Initialize, the index is built by the next Maintain().
+    void SetAddressIndex(bool enabled);
 
     // for statistics
     RegionType GetState(ptr_t address) override;
@@ -48,7 +76,11 @@ protected:
     // Block pool management
     LinkedListRegion* NewRegion();
     virtual void ReleaseRegion(LinkedListRegion* region);
-    void GrowPool();
+    bool GrowPool();        // returns false if there is no memory left for another pool
+    void ShrinkPool();
+    void AddPoolElements(LinkedListRegionPool* pool);
+    inline uint64_t FreePoolElements() const { return m_PoolCapacity - m_PoolUsedElements; }
+    void MoveRegion(LinkedListRegion* region);
 
     // Linked list operations
     LinkedListRegion* FindRegion(uint64_t base);
@@ -57,19 +89,57 @@ protected:
     virtual void DeleteRegion(LinkedListRegion* region);
     void DeleteAndReleaseRegion(LinkedListRegion* region);
 
+    // Called when a free region appears in the list, and before it is changed or removed
+    virtual void OnFreeRegionAdded(LinkedListRegion* region) { }
+    virtual void OnFreeRegionRemoved(LinkedListRegion* region) { }
+
+#if LINKED_LIST_ADDRESS_INDEX
+    // Address index
+    bool BuildIndex();      // (re)builds the index from the list, in freshly allocated chunks
+    void ReleaseIndex();
+    bool GrowIndex(uint64_t nodes);
+    void ShrinkIndex();
+
+    // free nodes kept for the allocator's own allocations, or up to the high watermark
+    inline uint64_t IndexSpareNodes() const
+    {
+        uint64_t reserve = 4ull * m_Index.Levels();
+        return (m_PoolHighWatermark > reserve) ? m_PoolHighWatermark : reserve;
+    }
+
+    inline void IndexRegion(LinkedListRegion* region)
+    {
+        // out of index nodes, walk the list until the index is rebuilt
+        if (m_IndexValid && !m_Index.Insert(region->Base, region))
+            m_IndexValid = false;
+    }
+#endif
+
 private:
     ptr_t AllocateInternal(uint32_t blocks, RegionType type);
+    void FreeInternal(uint64_t base);
+    LinkedListRegion* FreeRegion(LinkedListRegion* region);    // returns the merged region
+    void ShrinkAfterFree();
 
 protected:
     LinkedListRegion *m_First, *m_Last;
 
     uint64_t m_PoolCapacity;
     uint64_t m_PoolUsedElements;
+    uint64_t m_PoolLowWatermark;
+    uint64_t m_PoolHighWatermark;
 
     LinkedListRegionPool m_FirstPool;
     LinkedListRegion m_StaticRegionPool[STATIC_POOL_SIZE];
-    LinkedListRegionPool* m_CurrentPool;
-    uint32_t m_CurrentPoolNextFree;
+    LinkedListRegion* m_FreeElements;       // unused elements, linked through 'Next'
+
+#if LINKED_LIST_ADDRESS_INDEX
+    RadixIndex m_Index;
+    bool m_IndexEnabled;
+    bool m_IndexValid;
+    LinkedListIndexChunk* m_IndexChunks;
+    uint64_t m_IndexCapacity;               // nodes in all the chunks
+#endif
 };
 
 
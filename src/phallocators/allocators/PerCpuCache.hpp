@@ -0,0 +1,240 @@
+#pragma once
+#include "Allocator.hpp"
+#include "../util/ThreadIndex.hpp"
+#include <memory.h>
+#include <mutex>
+
+#define PER_CPU_CACHE_SLOTS     64      // threads are spread over this many caches
+#define PER_CPU_CACHE_SIZE      64      // single blocks held by every cache
+#define PER_CPU_CACHE_BATCH     32      // blocks moved from/to the backing allocator at once
+
+/**
+ * Keeps a small stack of free single blocks for every thread in front of TAllocator, like
+ * the per-CPU page lists kernels put in front of the buddy allocator. Allocate(1) and
+ * Free(base, 1) only touch the calling thread's cache; when it is empty or full, a batch
+ * of blocks is moved from or to TAllocator, under a lock. Bigger allocations go directly
+ * to TAllocator, under the same lock, so any allocator can be used from multiple threads.
+ *
+ * Threads are mapped to caches by their thread index; when there are more threads than
+ * caches, threads share them.
+ *
+ * Blocks held by the caches look reserved to TAllocator. If TAllocator runs out of memory,
+ * all the caches are given back to it before failing.
+ *
+ * A bitmap with a bit for every block, taken from TAllocator when initializing, marks the
+ * blocks handed out by Allocate(1). Free(base, 1) only caches marked blocks, so a double
+ * free can't put a block in the caches twice, even from two threads at once; other blocks
+ * go to TAllocator, unless they are already cached.
+ */
+template<typename TAllocator>
+class PerCpuCache : public TAllocator
+{
+public:
+    ptr_t Allocate(uint32_t blocks = 1) override
+    {
+        if (blocks == 1)
+        {
+            Cache& cache = LocalCache();
+            std::lock_guard<std::mutex> cacheLock(cache.Lock);
+
+            if (cache.Count == 0)
+                Refill(cache);
+
+            if (cache.Count > 0)
+                return HandOut(cache.Blocks[--cache.Count]);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(m_Lock);
+            ptr_t ret = TAllocator::Allocate(blocks);
+            if (ret != nullptr || blocks == 0)
+                return ret;
+        }
+
+        // the free memory might be sitting in the caches
+        Flush();
+
+        std::lock_guard<std::mutex> lock(m_Lock);
+        ptr_t ret = TAllocator::Allocate(blocks);
+        return (blocks == 1 && ret != nullptr) ? HandOut(ret) : ret;
+    }
+
+    void Free(ptr_t base, uint32_t blocks) override
+    {
+        if (blocks == 1)
+        {
+            Cache& cache = LocalCache();
+            {
+                // the mark is cleared and the block cached under the same lock, so a racing
+                // free of the block which finds the mark cleared finds it in IsCached
+                std::lock_guard<std::mutex> cacheLock(cache.Lock);
+                if (TakeBack(base))
+                {
+                    if (cache.Count == PER_CPU_CACHE_SIZE)
+                        Drain(cache, PER_CPU_CACHE_BATCH);
+
+                    cache.Blocks[cache.Count++] = base;
+                    return;
+                }
+            }
+
+            FreeUnknown(base);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(m_Lock);
+            TAllocator::Free(base, blocks);
+        }
+    }
+
+    void Maintain() override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        TAllocator::Maintain();
+    }
+
+    // gives all the cached blocks back to TAllocator
+    void Flush()
+    {
+        for (auto& cache : m_Caches)
+        {
+            std::lock_guard<std::mutex> cacheLock(cache.Lock);
+            Drain(cache, cache.Count);
+        }
+    }
+
+    // for statistics
+    RegionType GetState(ptr_t address) override
+    {
+        RegionType state;
+        {
+            std::lock_guard<std::mutex> lock(m_Lock);
+            state = TAllocator::GetState(address);
+        }
+
+        if (state != RegionType::Reserved)
+            return state;
+
+        if (IsBitmap(address))
+            return RegionType::Allocator;
+
+        // cached blocks are free
+        return IsCached(address) ? RegionType::Free : state;
+    }
+
+    uint64_t MeasureWastedMemory() override
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        return TAllocator::MeasureWastedMemory() + m_BitmapBlocks
+            + DivRoundUp<uint64_t>(sizeof(*this) - sizeof(TAllocator), this->m_BlockSize);
+    }
+
+protected:
+    bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override
+    {
+        if (!TAllocator::InitializeImpl(regions, regionCount))
+            return false;
+
+        uint64_t bitmapBytes = DivRoundUp<uint64_t>(this->m_MemSize, 64) * sizeof(uint64_t);
+        m_BitmapBlocks = DivRoundUp<uint64_t>(bitmapBytes, this->m_BlockSize);
+        m_HandedOut = reinterpret_cast<uint64_t*>(TAllocator::Allocate(m_BitmapBlocks));
+        if (m_HandedOut == nullptr)
+            return false;
+
+        memset(m_HandedOut, 0, bitmapBytes);
+        return true;
+    }
+
+private:
+    struct alignas(64) Cache
+    {
+        std::mutex Lock;
+        uint32_t Count = 0;
+        ptr_t Blocks[PER_CPU_CACHE_SIZE];
+    };
+
+    inline Cache& LocalCache()
+    {
+        return m_Caches[CurrentThreadIndex() % PER_CPU_CACHE_SLOTS];
+    }
+
+    // marks a block as handed out by Allocate(1)
+    ptr_t HandOut(ptr_t block)
+    {
+        uint64_t index = this->ToBlock(block);
+        __atomic_fetch_or(&m_HandedOut[index / 64], 1ull << (index % 64), __ATOMIC_RELAXED);
+        return block;
+    }
+
+    // clears the mark, returns false if the block wasn't handed out by Allocate(1)
+    bool TakeBack(ptr_t block)
+    {
+        uint64_t index = this->ToBlock(block);
+        if (index >= this->m_MemSize)
+            return false;
+
+        uint64_t mask = 1ull << (index % 64);
+        return (__atomic_fetch_and(&m_HandedOut[index / 64], ~mask, __ATOMIC_RELAXED) & mask) != 0;
+    }
+
+    inline bool IsBitmap(ptr_t address)
+    {
+        uint64_t block = this->ToBlock(address);
+        uint64_t bitmapBlock = this->ToBlock(m_HandedOut);
+        return block >= bitmapBlock && block < bitmapBlock + m_BitmapBlocks;
+    }
+
+    bool IsCached(ptr_t address)
+    {
+        uint64_t block = this->ToBlock(address);
+        for (auto& cache : m_Caches)
+        {
+            std::lock_guard<std::mutex> cacheLock(cache.Lock);
+            for (uint32_t i = 0; i < cache.Count; i++)
+                if (this->ToBlock(cache.Blocks[i]) == block)
+                    return true;
+        }
+
+        return false;
+    }
+
+    // a single block which wasn't handed out by Allocate(1); either it is already cached (double free),
+    // or it came from somewhere else and only TAllocator knows whether it can be freed
+    void FreeUnknown(ptr_t base)
+    {
+        if (IsCached(base) || IsBitmap(base))
+            return;
+
+        std::lock_guard<std::mutex> lock(m_Lock);
+        TAllocator::Free(base, 1);
+    }
+
+    // both are called with the cache's lock held
+    void Refill(Cache& cache)
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        while (cache.Count < PER_CPU_CACHE_BATCH)
+        {
+            ptr_t block = TAllocator::Allocate(1);
+            if (block == nullptr)
+                break;
+
+            cache.Blocks[cache.Count++] = block;
+        }
+    }
+
+    void Drain(Cache& cache, uint32_t count)
+    {
+        if (count == 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(m_Lock);
+        for (uint32_t i = 0; i < count; i++)
+            TAllocator::Free(cache.Blocks[--cache.Count], 1);
+    }
+
+    std::mutex m_Lock;          // protects TAllocator; taken after a cache's lock, never before
+    Cache m_Caches[PER_CPU_CACHE_SLOTS];
+    uint64_t* m_HandedOut = nullptr;    // a bit for every block, set while it is handed out by Allocate(1)
+    uint64_t m_BitmapBlocks = 0;
+};
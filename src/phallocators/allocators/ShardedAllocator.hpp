@@ -0,0 +1,221 @@
+#pragma once
+#include "Allocator.hpp"
+#include "../util/ThreadIndex.hpp"
+#include "../Debug.hpp"
+#include <mutex>
+#include <algorithm>
+
+// interleaved shards: memory is dealt out to the shards in chunks of at least this many blocks
+#define SHARD_INTERLEAVE_BLOCKS 512
+
+// most regions a shard is initialized with (Allocator::Initialize takes less than 1024)
+#define SHARD_MAX_REGIONS       1000
+
+enum class ShardPolicy
+{
+    Contiguous,         // every shard gets one contiguous range of memory
+    Interleaved,        // chunks of memory are given to the shards in turn
+};
+
+/**
+ * Splits memory into TShardCount shards, each managed by its own TAllocator behind its
+ * own lock. A thread allocates from its home shard (picked by thread index), and only
+ * goes to the other shards when its home shard can't satisfy the allocation. Free goes to
+ * the shard which owns the address.
+ *
+ * An allocation can't span shards, so it can't be bigger than a shard (contiguous) or
+ * than a chunk (interleaved). With interleaved shards, every shard covers the whole
+ * memory range, so allocators with a bitmap have a bitmap of the whole memory per shard.
+ * Shards whose allocator can't be initialized (e.g. no free memory to keep its data
+ * structures in) are left unused, along with their memory. Initialization fails if the
+ * memory map of a shard doesn't fit in SHARD_MAX_REGIONS regions.
+ */
+template<typename TAllocator, uint32_t TShardCount = 8, ShardPolicy TPolicy = ShardPolicy::Contiguous>
+class ShardedAllocator : public Allocator
+{
+    static_assert(TShardCount > 0, "Invalid shard count!");
+
+public:
+    ShardedAllocator()
+        : Allocator(),
+          m_ChunkSize(0)
+    {
+    }
+
+    // Fails for more blocks than a shard (contiguous) or a chunk (interleaved, at least
+    // SHARD_INTERLEAVE_BLOCKS), even when there is enough free memory: the blocks after
+    // the end of a chunk belong to another shard.
+    ptr_t Allocate(uint32_t blocks = 1) override
+    {
+        if (blocks == 0 || blocks > m_ChunkSize)
+            return nullptr;
+
+        // the home shard first, then the ones after it, so threads with different homes
+        // don't all steal from the same shard
+        uint32_t home = CurrentThreadIndex() % TShardCount;
+        for (uint32_t i = 0; i < TShardCount; i++)
+        {
+            Shard& shard = m_Shards[(home + i) % TShardCount];
+            if (!shard.Initialized)
+                continue;
+
+            std::lock_guard<std::mutex> lock(shard.Lock);
+            ptr_t ret = shard.Instance.Allocate(blocks);
+            if (ret != nullptr)
+                return ret;
+        }
+
+        return nullptr;
+    }
+
+    void Free(ptr_t base, uint32_t blocks) override
+    {
+        Shard& shard = ShardOf(base);
+        if (!shard.Initialized)
+            return;
+
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        shard.Instance.Free(base, blocks);
+    }
+
+    void Maintain() override
+    {
+        for (auto& shard : m_Shards)
+        {
+            if (!shard.Initialized)
+                continue;
+
+            std::lock_guard<std::mutex> lock(shard.Lock);
+            shard.Instance.Maintain();
+        }
+    }
+
+    // for statistics
+    RegionType GetState(ptr_t address) override
+    {
+        if (ToBlock(address) >= m_MemSize)
+            return RegionType::Unmapped;
+
+        Shard& shard = ShardOf(address);
+        if (!shard.Initialized)
+            return RegionType::Unmapped;
+
+        std::lock_guard<std::mutex> lock(shard.Lock);
+        return shard.Instance.GetState(address);
+    }
+
+    uint64_t MeasureWastedMemory() override
+    {
+        uint64_t total = DivRoundUp<uint64_t>(sizeof(*this) - TShardCount * sizeof(TAllocator), m_BlockSize);
+        for (auto& shard : m_Shards)
+        {
+            if (!shard.Initialized)
+                continue;
+
+            std::lock_guard<std::mutex> lock(shard.Lock);
+            total += shard.Instance.MeasureWastedMemory();
+        }
+        return total;
+    }
+
+protected:
+    bool InitializeImpl(RegionBlocks regions[], size_t regionCount) override
+    {
+        if (TPolicy == ShardPolicy::Contiguous)
+        {
+            m_ChunkSize = DivRoundUp<uint64_t>(m_MemSize, TShardCount);
+        }
+        else
+        {
+            // bigger chunks if a shard would end up with too many regions; one chunk covering
+            // all the memory is as big as they get
+            m_ChunkSize = SHARD_INTERLEAVE_BLOCKS;
+            while (m_ChunkSize < m_MemSize
+                   && 2 * DivRoundUp<uint64_t>(m_MemSize, m_ChunkSize * TShardCount) + regionCount > SHARD_MAX_REGIONS)
+                m_ChunkSize *= 2;
+        }
+
+        bool initialized = false;
+        for (uint32_t s = 0; s < TShardCount; s++)
+        {
+            size_t shardRegionCount = 0;
+            bool hasFree = false;
+
+            // the parts of every region which fall in the chunks of this shard
+            for (size_t i = 0; i < regionCount; i++)
+            {
+                uint64_t end = regions[i].Base + regions[i].Size;
+                for (uint64_t chunk = regions[i].Base / m_ChunkSize; chunk * m_ChunkSize < end; chunk++)
+                {
+                    if (chunk % TShardCount != s)
+                        continue;
+
+                    uint64_t pieceBase = std::max(regions[i].Base, chunk * m_ChunkSize);
+                    uint64_t pieceEnd = std::min(end, (chunk + 1) * m_ChunkSize);
+
+                    if (shardRegionCount == SHARD_MAX_REGIONS)
+                        return TooManyRegions(s);
+
+                    m_ShardRegions[shardRegionCount++] = { ToPtr(pieceBase), (pieceEnd - pieceBase) * m_BlockSize, regions[i].Type };
+                    hasFree |= (regions[i].Type == RegionType::Free);
+                }
+            }
+
+            // the list and tree allocators merge free regions which are next to each other in their
+            // list, so the chunks of the other shards in between are given to them as reserved
+            for (uint64_t chunk = s; (chunk + TShardCount) * m_ChunkSize < m_MemSize; chunk += TShardCount)
+            {
+                if (shardRegionCount == SHARD_MAX_REGIONS)
+                    return TooManyRegions(s);
+
+                m_ShardRegions[shardRegionCount++] = { ToPtr((chunk + 1) * m_ChunkSize), (TShardCount - 1) * m_ChunkSize * m_BlockSize, RegionType::Reserved };
+            }
+
+            Shard& shard = m_Shards[s];
+            shard.Initialized = hasFree && shard.Instance.Initialize(m_BlockSize, m_ShardRegions, shardRegionCount);
+            initialized |= shard.Initialized;
+        }
+
+        return initialized;
+    }
+
+    void DumpImpl(JsonWriter& writer) override
+    {
+        writer.Property("policy", static_cast<int>(TPolicy));
+        writer.Property("chunkSize", m_ChunkSize);
+        writer.BeginArray("shards");
+
+        for (uint32_t s = 0; s < TShardCount; s++)
+        {
+            writer.BeginObject();
+            writer.Property("id", s);
+            writer.Property("initialized", m_Shards[s].Initialized);
+            writer.EndObject();
+        }
+
+        writer.EndArray();
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        std::mutex Lock;
+        bool Initialized = false;
+        TAllocator Instance;
+    };
+
+    inline Shard& ShardOf(ptr_t address)
+    {
+        return m_Shards[(ToBlock(address) / m_ChunkSize) % TShardCount];
+    }
+
+    bool TooManyRegions(uint32_t shard)
+    {
+        Debug::Error("ShardedAllocator", "The memory map of shard %u needs more than %u regions!", shard, SHARD_MAX_REGIONS);
+        return false;
+    }
+
+    uint64_t m_ChunkSize;           // in blocks; with contiguous shards, the size of a shard
+    Shard m_Shards[TShardCount];
+    Region m_ShardRegions[SHARD_MAX_REGIONS];   // memory map of the shard being initialized, kept off the stack
+};
@@ -0,0 +1,97 @@
+#include "TLSFAllocator.hpp"
+#include <math/MathHelpers.hpp>
+
+TLSFAllocator::TLSFAllocator()
+    : LinkedListAllocator(),
+      m_FirstLevelBitmap(0),
+      m_SecondLevelBitmap(),
+      m_FreeLists()
+{
+    // Free needs the index to find the region in O(log n), like the rest of TLSF's operations
+    SetAddressIndex(true);
+}
+
+void TLSFAllocator::Mapping(uint64_t size, int& firstLevel, int& secondLevel)
+{
+    if (size < SmallSize)
+    {
+        firstLevel = 0;
+        secondLevel = static_cast<int>(size);
+    }
+    else
+    {
+        int log = 63 - __builtin_clzll(size);
+        firstLevel = log - SecondLevelBits + 1;
+        secondLevel = static_cast<int>((size >> (log - SecondLevelBits)) ^ SecondLevelCount);
+    }
+}
+
+LinkedListRegion* TLSFAllocator::FindFreeRegion(uint32_t blocks)
+{
+    // round up to the next list, so that any region in the list we find is big enough
+    uint64_t size = blocks;
+    if (size >= SmallSize)
+        size += (1ull << (63 - __builtin_clzll(size) - SecondLevelBits)) - 1;
+
+    int firstLevel, secondLevel;
+    Mapping(size, firstLevel, secondLevel);
+    if (firstLevel >= FirstLevelCount)
+        return nullptr;
+
+    // look for a non-empty list in the same first level list
+    uint32_t secondLevelMap = m_SecondLevelBitmap[firstLevel] & (~0u << secondLevel);
+    if (secondLevelMap == 0)
+    {
+        // look in the bigger first level lists
+        uint64_t firstLevelMap = (firstLevel + 1 < 64) ? m_FirstLevelBitmap & (~0ull << (firstLevel + 1)) : 0;
+        if (firstLevelMap == 0)
+            return nullptr;
+
+        firstLevel = CountTrailingZeros(firstLevelMap);
+        secondLevelMap = m_SecondLevelBitmap[firstLevel];
+    }
+
+    secondLevel = CountTrailingZeros(secondLevelMap);
+    return m_FreeLists[firstLevel][secondLevel]->Region;
+}
+
+void TLSFAllocator::OnFreeRegionAdded(LinkedListRegion* region)
+{
+    int firstLevel, secondLevel;
+    Mapping(region->Size, firstLevel, secondLevel);
+
+    TLSFFreeNode* node = ToNode(region);
+    node->Region = region;
+    node->Prev = nullptr;
+    node->Next = m_FreeLists[firstLevel][secondLevel];
+
+    if (node->Next != nullptr)
+        node->Next->Prev = node;
+
+    m_FreeLists[firstLevel][secondLevel] = node;
+    m_FirstLevelBitmap |= (1ull << firstLevel);
+    m_SecondLevelBitmap[firstLevel] |= (1u << secondLevel);
+}
+
+void TLSFAllocator::OnFreeRegionRemoved(LinkedListRegion* region)
+{
+    int firstLevel, secondLevel;
+    Mapping(region->Size, firstLevel, secondLevel);
+
+    TLSFFreeNode* node = ToNode(region);
+    if (node->Prev == nullptr)
+        m_FreeLists[firstLevel][secondLevel] = node->Next;
+    else
+        node->Prev->Next = node->Next;
+
+    if (node->Next != nullptr)
+        node->Next->Prev = node->Prev;
+
+    // list is now empty
+    if (m_FreeLists[firstLevel][secondLevel] == nullptr)
+    {
+        m_SecondLevelBitmap[firstLevel] &= ~(1u << secondLevel);
+        if (m_SecondLevelBitmap[firstLevel] == 0)
+            m_FirstLevelBitmap &= ~(1ull << firstLevel);
+    }
+}
@@ -0,0 +1,49 @@
+#include "LinkedListAllocator.hpp"
+
+/**
+ * Node of a TLSF free list, stored at the beginning of the free region
+ */
+struct TLSFFreeNode
+{
+    LinkedListRegion* Region;
+    TLSFFreeNode* Next;
+    TLSFFreeNode* Prev;
+};
+
+/**
+ * Two level segregated fit allocator. Regions are kept in the same address ordered
+ * list as in the linked list allocator (for merging neighbours), but the free regions
+ * are also kept in segregated lists by size: the first level splits the sizes in powers
+ * of 2, the second level splits every power of 2 into SecondLevelCount linear ranges.
+ *
+ * Two levels of bitmaps tell which lists are not empty, so a good fit is found in O(1).
+ */
+class TLSFAllocator : public LinkedListAllocator
+{
+public:
+    static constexpr int SecondLevelBits = 4;
+    static constexpr int SecondLevelCount = 1 << SecondLevelBits;
+
+    // sizes smaller than this are all in the first list
+    static constexpr uint64_t SmallSize = SecondLevelCount;
+    static constexpr int FirstLevelCount = 64 - SecondLevelBits + 1;
+
+    TLSFAllocator();
+
+protected:
+    LinkedListRegion* FindFreeRegion(uint32_t blocks) override;
+    void OnFreeRegionAdded(LinkedListRegion* region) override;
+    void OnFreeRegionRemoved(LinkedListRegion* region) override;
+
+private:
+    static void Mapping(uint64_t size, int& firstLevel, int& secondLevel);
+
+    inline TLSFFreeNode* ToNode(LinkedListRegion* region)
+    {
+        return reinterpret_cast<TLSFFreeNode*>(ToPtr(region->Base));
+    }
+
+    uint64_t m_FirstLevelBitmap;
+    uint32_t m_SecondLevelBitmap[FirstLevelCount];
+    TLSFFreeNode* m_FreeLists[FirstLevelCount][SecondLevelCount];
+};
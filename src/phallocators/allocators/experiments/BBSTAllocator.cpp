@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <math/MathHelpers.hpp>
 #include <util/JsonWriter.hpp>
+#include <Debug.hpp>
 
 BBSTRegion::BBSTRegion(uint64_t base,
                     uint64_t size,
@@ -14,27 +15,70 @@ BBSTRegion::BBSTRegion(uint64_t base,
 
 BBSTAllocator::BBSTAllocator()
     : Allocator(),
-      m_Map()
+      m_Nodes(),
+      m_Map(&m_Nodes)
 {
 }
 
 bool BBSTAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 {
+    // 1 node for every region, 1 for splitting off the node blocks, and the reserve
+    uint64_t nodes = regionCount + 1 + NODE_POOL_RESERVE;
+    uint64_t nodeBlocks = 0;
+    if (nodes > m_Nodes.FreeNodes())
+        nodeBlocks = DivRoundUp<uint64_t>((nodes - m_Nodes.FreeNodes()) * NODE_POOL_NODE_SIZE, m_BlockSize);
+
+    // the nodes which don't fit in the static pool are taken from a free region
+    RegionBlocks* nodeRegion = nullptr;
+    if (nodeBlocks > 0)
+    {
+        for (size_t i = 0; i < regionCount; i++)
+        {
+            if (regions[i].Type == RegionType::Free && regions[i].Size >= nodeBlocks)
+                nodeRegion = &regions[i];
+        }
+
+        if (nodeRegion == nullptr)
+        {
+            Debug::Error("BBSTAllocator", "Not enough free memory - needed %u blocks!", nodeBlocks);
+            return false;
+        }
+
+        m_Nodes.AddNodes(ToPtr(nodeRegion->Base), nodeBlocks * m_BlockSize);
+    }
+
     for (size_t i = 0; i < regionCount; i++)
     {
-        m_Map.emplace(regions[i].Base, BBSTRegion(regions[i].Base, regions[i].Size, regions[i].Type));
+        if (&regions[i] == nodeRegion)
+        {
+            m_Map->emplace(regions[i].Base, BBSTRegion(regions[i].Base, nodeBlocks, RegionType::Allocator));
+            if (regions[i].Size > nodeBlocks)
+                m_Map->emplace(regions[i].Base + nodeBlocks, BBSTRegion(regions[i].Base + nodeBlocks, regions[i].Size - nodeBlocks, RegionType::Free));
+        }
+        else m_Map->emplace(regions[i].Base, BBSTRegion(regions[i].Base, regions[i].Size, regions[i].Type));
     }
 
     return true;
 }
 
 ptr_t BBSTAllocator::Allocate(uint32_t blocks)
+{
+    ptr_t ret = AllocateInternal(blocks, RegionType::Reserved);
+
+    // keep enough nodes for the next operation
+    if (m_Nodes.FreeNodes() < NODE_POOL_RESERVE)
+        GrowNodes();
+
+    return ret;
+}
+
+ptr_t BBSTAllocator::AllocateInternal(uint32_t blocks, RegionType type)
 {
     if (blocks == 0)
         return nullptr;
 
     // find region
-    for (auto it = m_Map.begin(); it != m_Map.end(); it++)
+    for (auto it = m_Map->begin(); it != m_Map->end(); it++)
     {
         if (it->second.Type == RegionType::Free && it->second.Size >= blocks)
         {
@@ -43,17 +87,21 @@ ptr_t BBSTAllocator::Allocate(uint32_t blocks)
             // size is equal, just modify the type of the existing block
             if (it->second.Size == blocks)
             {
-                it->second.Type = RegionType::Reserved;
+                it->second.Type = type;
             }
             else
             {
+                // splitting takes a node; only growing the pool can go below the minimum
+                if (m_Nodes.FreeNodes() < ((type == RegionType::Allocator) ? 1 : 1 + NODE_POOL_MIN_FREE))
+                    return nullptr;
+
                 BBSTRegion block = it->second;
-                m_Map.erase(it);
-                m_Map.emplace(block.Base, BBSTRegion(block.Base, blocks, RegionType::Reserved));
+                m_Map->erase(it);
+                m_Map->emplace(block.Base, BBSTRegion(block.Base, blocks, type));
 
                 block.Base += blocks;
                 block.Size -= blocks;
-                m_Map.emplace(block.Base, block);
+                m_Map->emplace(block.Base, block);
             }
             return ret;
         }
@@ -67,16 +115,16 @@ void BBSTAllocator::Free(void* basePtr, uint32_t blocks)
     uint64_t base = ToBlock(basePtr);
 
     // Find node
-    auto it = m_Map.find(base);
+    auto it = m_Map->find(base);
     
-    // not found, or region is already free
-    if (it == m_Map.end())
+    // not found, or region is free or holds the allocator's nodes
+    if (it == m_Map->end() || it->second.Type != RegionType::Reserved)
         return;
 
     it->second.Type = RegionType::Free;
 
     // can we merge with predecessor?
-    if (it != m_Map.begin())
+    if (it != m_Map->begin())
     {
         auto prev = it;
         --prev;
@@ -84,7 +132,7 @@ void BBSTAllocator::Free(void* basePtr, uint32_t blocks)
         if (prev->second.Type == RegionType::Free)
         {
             prev->second.Size += it->second.Size;
-            m_Map.erase(it);
+            m_Map->erase(it);
             it = prev;
         }
     }
@@ -92,20 +140,27 @@ void BBSTAllocator::Free(void* basePtr, uint32_t blocks)
     // can we merge with the successor
     auto next = it;
     ++next;
-    if (next != m_Map.end() && next->second.Type == RegionType::Free)
+    if (next != m_Map->end() && next->second.Type == RegionType::Free)
     {
         it->second.Size += next->second.Size;
-        m_Map.erase(next);
+        m_Map->erase(next);
     }
 }
 
+void BBSTAllocator::GrowNodes()
+{
+    ptr_t memory = AllocateInternal(1, RegionType::Allocator);
+    if (memory != nullptr)
+        m_Nodes.AddNodes(memory, m_BlockSize);
+}
+
 // for statistics
 RegionType BBSTAllocator::GetState(ptr_t address)
 {
     uint64_t block = ToBlock(address);
 
-    auto it = m_Map.upper_bound(block);     // returns iterator to first element GREATER than 'block'
-    if (it == m_Map.begin())
+    auto it = m_Map->upper_bound(block);     // returns iterator to first element GREATER than 'block'
+    if (it == m_Map->begin())
         return RegionType::Unmapped;
 
     --it;
@@ -120,7 +175,7 @@ void BBSTAllocator::DumpImpl(JsonWriter& writer)
 {
     writer.BeginArray("blockList");
 
-    for (auto& pair : m_Map)
+    for (auto& pair : *m_Map)
     {
         writer.BeginObject();
         writer.Property("base", pair.second.Base);
@@ -134,7 +189,11 @@ void BBSTAllocator::DumpImpl(JsonWriter& writer)
 
 uint64_t BBSTAllocator::MeasureWastedMemory()
 {
-    // not accurate
-    size_t mapSize = sizeof(m_Map) + m_Map.size() * sizeof(std::multimap<uint64_t, BBSTRegion>::node_type); // NOLINT(bugprone-sizeof-container)
-    return DivRoundUp(sizeof(*this) + mapSize, m_BlockSize);
+    uint64_t total = DivRoundUp(sizeof(*this), m_BlockSize);
+    for (auto& pair : *m_Map)
+    {
+        if (pair.second.Type == RegionType::Allocator)
+            total += pair.second.Size;
+    }
+    return total;
 }
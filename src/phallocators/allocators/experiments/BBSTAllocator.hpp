@@ -1,4 +1,5 @@
 #include "../Allocator.hpp"
+#include "../../util/NodePoolResource.hpp"
 #include <map>
 
 struct BBSTRegion
@@ -17,7 +18,8 @@ struct BBSTRegion
  * - implemented using std::map because it uses black-red trees,
  * and because implementing black-red trees is hard
  * 
- * Note: not suitable for an OS because it uses std::map
+ * The map nodes come from blocks taken from the managed memory (marked as
+ * RegionType::Allocator), not from the heap.
  */
 class BBSTAllocator : public Allocator
 {
@@ -35,5 +37,9 @@ protected:
     void DumpImpl(JsonWriter& writer) override;
 
 private:
-    std::map<uint64_t, BBSTRegion> m_Map;
+    ptr_t AllocateInternal(uint32_t blocks, RegionType type);
+    void GrowNodes();
+
+    NodePoolResource m_Nodes;
+    NoDestructor<std::pmr::map<uint64_t, BBSTRegion>> m_Map;
 };
\ No newline at end of file
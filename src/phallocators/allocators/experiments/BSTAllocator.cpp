@@ -1,7 +1,9 @@
 #include "BSTAllocator.hpp"
 #include <memory.h>
+#include <cassert>
 #include <math/MathHelpers.hpp>
 #include <util/JsonWriter.hpp>
+#include <Debug.hpp>
 
 void BSTRegion::Clear()
 {
@@ -21,6 +23,8 @@ void BSTRegion::Set(uint64_t base,
     this->Parent = parent;
     this->Left = left;
     this->Right = right;
+    this->MaxFree = (type == RegionType::Free) ? size : 0;
+    this->Red = false;
     this->BlockUsed = true;
 }
 
@@ -29,15 +33,17 @@ BSTAllocator::BSTAllocator()
       m_Root(nullptr),
       m_TotalCapacity(STATIC_POOL_SIZE),
       m_UsedElements(0),
+      m_PoolLowWatermark(0),
+      m_PoolHighWatermark(0),
       m_FirstPool(),
 	  m_StaticRegionPool(),
-      m_CurrentPool(&m_FirstPool),
-      m_CurrentPoolNextFree(0)
+      m_FreeRegions(nullptr)
 {
     memset(m_StaticRegionPool, 0, sizeof(m_StaticRegionPool));
     m_FirstPool.Regions  = m_StaticRegionPool;
     m_FirstPool.Size = STATIC_POOL_SIZE;
     m_FirstPool.Next = &m_FirstPool;
+    AddPoolRegions(&m_FirstPool);
 }
 
 bool BSTAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
@@ -46,6 +52,14 @@ bool BSTAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 
     for (size_t i = 0; i < regionCount; i++)
     {
+        // the static pool can be too small for the memory map; more pools are taken from
+        // the free regions added so far
+        if (FreePoolRegions() < POOL_RESERVE_ELEMENTS && !GrowPool() && FreePoolRegions() == 0)
+        {
+            Debug::Error("BSTAllocator", "Not enough free memory for the regions - needed %u!", regionCount);
+            return false;
+        }
+
         BSTRegion* region = NewRegion();
 	    region->Set(regions[i].Base, regions[i].Size, regions[i].Type);
 	    InsertRegion(region);
@@ -58,20 +72,17 @@ ptr_t BSTAllocator::Allocate(uint32_t blocks)
 {
     ptr_t ret = AllocateInternal(blocks, RegionType::Reserved);
 
-    // over 80% usage => add another block pool
-    if (m_UsedElements >= (m_TotalCapacity * 4) / 5)
+    if (m_PoolLowWatermark == 0)
     {
-        // allocate another pool
-        auto* u8NewPool = reinterpret_cast<uint8_t*>(AllocateInternal(1, RegionType::Allocator));
-        
-        auto* newPool = reinterpret_cast<BSTRegionPool*>(u8NewPool);
-        newPool->Regions = reinterpret_cast<BSTRegion*>(u8NewPool + sizeof(BSTRegionPool));
-        newPool->Size = (m_BlockSize - sizeof(BSTRegionPool)) / sizeof(BSTRegion);
-        memset(newPool->Regions, 0, sizeof(BSTRegion) * newPool->Size);
-
-        newPool->Next = m_FirstPool.Next;
-        m_FirstPool.Next = newPool;
-        m_TotalCapacity += newPool->Size;
+        // over 80% usage => add another block pool
+        if (m_UsedElements >= (m_TotalCapacity * 4) / 5)
+            GrowPool();
+    }
+    else
+    {
+        // Maintain() wasn't called in time
+        if (FreePoolRegions() < POOL_RESERVE_ELEMENTS)
+            GrowPool();
     }
 
     return ret;
@@ -85,8 +96,8 @@ ptr_t BSTAllocator::AllocateInternal(uint32_t blocks, RegionType type)
     // find region
     BSTRegion* found = FindFreeRegion(m_Root, blocks);
 
-    // out of memory?
-    if (found == nullptr)
+    // out of memory? (splitting the block needs a free region)
+    if (found == nullptr || (found->Size != blocks && m_FreeRegions == nullptr))
         return nullptr;
 
     ptr_t ret = ToPtr(found->Base);
@@ -96,19 +107,20 @@ ptr_t BSTAllocator::AllocateInternal(uint32_t blocks, RegionType type)
     {
         // size is equal, just modify the type of the existing block
         found->Type = type;
+        UpdateMaxFreeToRoot(found);
     }
     else
     {
-        // size not equal, split block in 2
+        // size not equal, split block in 2; 'found' keeps its place in the tree, the new
+        // block goes right before it
         BSTRegion* newBlock = NewRegion();
         newBlock->Set(found->Base, blocks, type);
 
         found->Base += blocks;
         found->Size -= blocks;
 
-	    DeleteRegion(found);
 	    InsertRegion(newBlock);
-	    InsertRegion(found);
+        UpdateMaxFreeToRoot(found);
     }
 
     return ret;    
@@ -116,35 +128,102 @@ ptr_t BSTAllocator::AllocateInternal(uint32_t blocks, RegionType type)
 
 BSTRegion* BSTAllocator::FindFreeRegion(BSTRegion* root, size_t blocks)
 {
-    // find region
-    if (root == nullptr)
+    // nothing big enough in the whole tree
+    if (root == nullptr || root->MaxFree < blocks)
         return nullptr;
 
-    // found
-    if (root->Type == RegionType::Free && root->Size >= blocks)
-        return root;
+    // lowest address first: go left whenever the left subtree has a fitting region
+    BSTRegion* current = root;
+    while (true)
+    {
+        if (current->Left != nullptr && current->Left->MaxFree >= blocks)
+            current = current->Left;
+        else if (current->Type == RegionType::Free && current->Size >= blocks)
+            return current;
+        else
+            current = current->Right;
+    }
+}
 
-    // go left
-    BSTRegion* left = FindFreeRegion(root->Left, blocks);
-    if (left != nullptr)
-        return left;
+void BSTAllocator::Free(void* basePtr, uint32_t blocks)
+{
+    FreeInternal(ToBlock(basePtr));
 
-    // go right
-    return FindFreeRegion(root->Right, blocks);
+    // under 20% usage => compact the regions and free up some pools
+    if (m_PoolLowWatermark == 0 && m_FirstPool.Next != &m_FirstPool && m_UsedElements < m_TotalCapacity / 5)
+        ShrinkPool();
 }
 
-void BSTAllocator::Free(void* basePtr, uint32_t blocks)
+void BSTAllocator::FreeSorted(const ptr_t bases[], size_t count)
+{
+    BSTRegion* current = nullptr;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t base = ToBlock(bases[i]);
+
+        // neighbouring frees are usually a few successors away
+        for (int steps = 0; current != nullptr && current->Base < base && steps < 4; steps++)
+            current = GetSuccessor(current);
+
+        if (current == nullptr || current->Base != base)
+            current = FindRegion(base);
+
+        if (current != nullptr)
+            current = FreeRegion(current);
+    }
+
+    if (m_PoolLowWatermark == 0 && m_FirstPool.Next != &m_FirstPool && m_UsedElements < m_TotalCapacity / 5)
+        ShrinkPool();
+}
+
+void BSTAllocator::Maintain()
+{
+    if (m_PoolLowWatermark == 0)
+        return;
+
+    if (FreePoolRegions() < m_PoolLowWatermark)
+    {
+        while (FreePoolRegions() < m_PoolHighWatermark)
+        {
+            // out of memory, try again next time
+            if (!GrowPool())
+                break;
+        }
+    }
+    else if (m_FirstPool.Next != &m_FirstPool && m_UsedElements < m_TotalCapacity / 5)
+        ShrinkPool();
+}
+
+void BSTAllocator::SetPoolWatermarks(uint64_t low, uint64_t high)
+{
+    if (low != 0 && low < POOL_RESERVE_ELEMENTS)
+        low = POOL_RESERVE_ELEMENTS;
+
+    m_PoolLowWatermark = low;
+    m_PoolHighWatermark = (high > low) ? high : low;
+}
+
+void BSTAllocator::FreeInternal(uint64_t base)
 {
-    uint64_t base = ToBlock(basePtr);
+    BSTRegion* current = FindRegion(base);
+    if (current != nullptr)
+        FreeRegion(current);
+}
 
-    // Find node
+BSTRegion* BSTAllocator::FindRegion(uint64_t base)
+{
     BSTRegion* current = m_Root;
     while (current != nullptr && current->Base != base)
         current = (base < current->Base) ? current->Left : current->Right;
-    
-    // not found, or region is already free
-    if (current == nullptr || current->Type == RegionType::Free)
-        return;
+
+    return current;
+}
+
+BSTRegion* BSTAllocator::FreeRegion(BSTRegion* current)
+{
+    // region is already free
+    if (current->Type == RegionType::Free)
+        return current;
 
     current->Type = RegionType::Free;
 
@@ -165,35 +244,134 @@ void BSTAllocator::Free(void* basePtr, uint32_t blocks)
 	    DeleteAndReleaseRegion(next);
     }
 
-    // TODO: under 20% usage? compress and free up some pools
+    UpdateMaxFreeToRoot(current);
+    return current;
 }
 
 BSTRegion* BSTAllocator::NewRegion()
 {
+    assert(m_UsedElements < m_TotalCapacity);
+    assert(m_FreeRegions != nullptr);
+
+    BSTRegion* region = m_FreeRegions;
+    m_FreeRegions = region->Right;
+
+    ++m_UsedElements;
+    return region;
+}
+
+void BSTAllocator::ReleaseRegion(BSTRegion* region)
+{
+	region->Clear();
+    region->Right = m_FreeRegions;
+    m_FreeRegions = region;
+    m_UsedElements--;
+}
+
+bool BSTAllocator::GrowPool()
+{
+    // allocate another pool
+    auto* u8NewPool = reinterpret_cast<uint8_t*>(AllocateInternal(1, RegionType::Allocator));
+    if (u8NewPool == nullptr)
+        return false;
+
+    auto* newPool = reinterpret_cast<BSTRegionPool*>(u8NewPool);
+    newPool->Regions = reinterpret_cast<BSTRegion*>(u8NewPool + sizeof(BSTRegionPool));
+    newPool->Size = (m_BlockSize - sizeof(BSTRegionPool)) / sizeof(BSTRegion);
+    memset(newPool->Regions, 0, sizeof(BSTRegion) * newPool->Size);
+
+    newPool->Next = m_FirstPool.Next;
+    m_FirstPool.Next = newPool;
+    m_TotalCapacity += newPool->Size;
+    AddPoolRegions(newPool);
+    return true;
+}
+
+void BSTAllocator::ShrinkPool()
+{
+    // take out pools, as long as the remaining ones stay under 50% usage
+    BSTRegionPool* released = nullptr;
+    BSTRegionPool* prev = &m_FirstPool;
+    while (prev->Next != &m_FirstPool)
+    {
+        BSTRegionPool* pool = prev->Next;
+        if (m_TotalCapacity - pool->Size < 2 * m_UsedElements
+            || m_TotalCapacity - pool->Size < m_UsedElements + m_PoolHighWatermark)
+        {
+            prev = pool;
+            continue;
+        }
+
+        prev->Next = pool->Next;
+        pool->Next = released;
+        released = pool;
+        m_TotalCapacity -= pool->Size;
+    }
+
+    if (released == nullptr)
+        return;
+
+    // only the unused regions of the remaining pools can be handed out
+    m_FreeRegions = nullptr;
+    BSTRegionPool* pool = &m_FirstPool;
     do {
-        if (m_CurrentPoolNextFree >= m_CurrentPool->Size)
+        for (uint64_t i = pool->Size; i > 0; i--)
         {
-            m_CurrentPool = m_CurrentPool->Next;
-            m_CurrentPoolNextFree = 0;
+            if (!pool->Regions[i - 1].BlockUsed)
+            {
+                pool->Regions[i - 1].Right = m_FreeRegions;
+                m_FreeRegions = &pool->Regions[i - 1];
+            }
         }
-        if (m_CurrentPool == nullptr)
+        pool = pool->Next;
+    } while (pool != &m_FirstPool);
+
+    // move the regions still in use out of the released pools
+    for (pool = released; pool != nullptr; pool = pool->Next)
+    {
+        for (uint64_t i = 0; i < pool->Size; i++)
         {
-            m_CurrentPool = &m_FirstPool;
-            m_CurrentPoolNextFree = 0;
+            if (pool->Regions[i].BlockUsed)
+                MoveRegion(&pool->Regions[i]);
         }
-       
-    } while (m_CurrentPool->Regions[m_CurrentPoolNextFree++].BlockUsed);
+    }
 
-    ++m_UsedElements;
-    return &m_CurrentPool->Regions[m_CurrentPoolNextFree - 1];
+    // give the pool blocks back
+    while (released != nullptr)
+    {
+        BSTRegionPool* next = released->Next;
+        FreeInternal(ToBlock(released));
+        released = next;
+    }
 }
 
-void BSTAllocator::ReleaseRegion(BSTRegion* region)
+void BSTAllocator::MoveRegion(BSTRegion* region)
 {
-	region->Clear();
+    BSTRegion* moved = NewRegion();
+    *moved = *region;
+
+    // take the place of the old node in the tree
+    ReplaceRegionWith(region, moved);
+    if (moved->Left != nullptr)
+        moved->Left->Parent = moved;
+    if (moved->Right != nullptr)
+        moved->Right->Parent = moved;
+
+    // the old region is not put back in the free list, its pool is going away
+    region->Clear();
     m_UsedElements--;
 }
 
+void BSTAllocator::AddPoolRegions(BSTRegionPool* pool)
+{
+    // add in reverse, so the regions are handed out in order
+    for (uint64_t i = pool->Size; i > 0; i--)
+    {
+        pool->Regions[i - 1].Right = m_FreeRegions;
+        m_FreeRegions = &pool->Regions[i - 1];
+    }
+}
+
 void BSTAllocator::InsertRegion(BSTRegion* region)
 {
     BSTRegion* parent = nullptr;
@@ -208,37 +386,264 @@ void BSTAllocator::InsertRegion(BSTRegion* region)
 
     // insert
 	region->Parent = parent;
+    region->Left = nullptr;
+    region->Right = nullptr;
+    region->Red = true;
+
     if (parent == nullptr)
         m_Root = region;
     else if (region->Base < parent->Base)
         parent->Left = region;
     else
         parent->Right = region;
+
+    UpdateMaxFreeToRoot(region);
+    InsertFixup(region);
+}
+
+void BSTAllocator::InsertFixup(BSTRegion* region)
+{
+    // a red node can't have a red parent
+    while (region->Parent != nullptr && region->Parent->Red)
+    {
+        BSTRegion* parent = region->Parent;
+        BSTRegion* grandparent = parent->Parent;
+
+        if (parent == grandparent->Left)
+        {
+            BSTRegion* uncle = grandparent->Right;
+            if (uncle != nullptr && uncle->Red)
+            {
+                // push the blackness down from the grandparent
+                parent->Red = false;
+                uncle->Red = false;
+                grandparent->Red = true;
+                region = grandparent;
+            }
+            else
+            {
+                if (region == parent->Right)
+                {
+                    region = parent;
+                    RotateLeft(region);
+                    parent = region->Parent;
+                }
+
+                parent->Red = false;
+                grandparent->Red = true;
+                RotateRight(grandparent);
+            }
+        }
+        else
+        {
+            BSTRegion* uncle = grandparent->Left;
+            if (uncle != nullptr && uncle->Red)
+            {
+                parent->Red = false;
+                uncle->Red = false;
+                grandparent->Red = true;
+                region = grandparent;
+            }
+            else
+            {
+                if (region == parent->Left)
+                {
+                    region = parent;
+                    RotateRight(region);
+                    parent = region->Parent;
+                }
+
+                parent->Red = false;
+                grandparent->Red = true;
+                RotateLeft(grandparent);
+            }
+        }
+    }
+
+    m_Root->Red = false;
 }
 
 void BSTAllocator::DeleteRegion(BSTRegion* region)
 {
+    // 'child' takes the place of the node which is taken out of the tree
+    BSTRegion* child;
+    BSTRegion* childParent;
+    bool removedRed = region->Red;
+
     if (region->Left == nullptr)
+    {
+        child = region->Right;
+        childParent = region->Parent;
 	    ReplaceRegionWith(region, region->Right);
+    }
     else if (region->Right == nullptr)
+    {
+        child = region->Left;
+        childParent = region->Parent;
 	    ReplaceRegionWith(region, region->Left);
+    }
     else
     {
         BSTRegion* next = GetSuccessor(region);
+        removedRed = next->Red;
+        child = next->Right;
+
         if (next->Parent != region)
         {
+            childParent = next->Parent;
 	        ReplaceRegionWith(next, next->Right);
             next->Right = region->Right;
             next->Right->Parent = next;
         }
+        else childParent = next;
+
 	    ReplaceRegionWith(region, next);
         next->Left = region->Left;
         next->Left->Parent = next;
+        next->Red = region->Red;
     }
 
-	region->Parent = nullptr;
-	region->Left = nullptr;
-	region->Right = nullptr;
+    // the rotations in the fixup expect correct values below them
+    UpdateMaxFreeToRoot(childParent);
+
+    if (!removedRed)
+        DeleteFixup(child, childParent);
+
+    region->Parent = nullptr;
+    region->Left = nullptr;
+    region->Right = nullptr;
+}
+
+void BSTAllocator::DeleteFixup(BSTRegion* region, BSTRegion* parent)
+{
+    // 'region' (which can be null) is missing one black node on its paths
+    while (region != m_Root && (region == nullptr || !region->Red))
+    {
+        if (region == parent->Left)
+        {
+            BSTRegion* sibling = parent->Right;
+            if (sibling->Red)
+            {
+                sibling->Red = false;
+                parent->Red = true;
+                RotateLeft(parent);
+                sibling = parent->Right;
+            }
+
+            if ((sibling->Left == nullptr || !sibling->Left->Red)
+                && (sibling->Right == nullptr || !sibling->Right->Red))
+            {
+                sibling->Red = true;
+                region = parent;
+                parent = region->Parent;
+            }
+            else
+            {
+                if (sibling->Right == nullptr || !sibling->Right->Red)
+                {
+                    sibling->Left->Red = false;
+                    sibling->Red = true;
+                    RotateRight(sibling);
+                    sibling = parent->Right;
+                }
+
+                sibling->Red = parent->Red;
+                parent->Red = false;
+                sibling->Right->Red = false;
+                RotateLeft(parent);
+                region = m_Root;
+            }
+        }
+        else
+        {
+            BSTRegion* sibling = parent->Left;
+            if (sibling->Red)
+            {
+                sibling->Red = false;
+                parent->Red = true;
+                RotateRight(parent);
+                sibling = parent->Left;
+            }
+
+            if ((sibling->Left == nullptr || !sibling->Left->Red)
+                && (sibling->Right == nullptr || !sibling->Right->Red))
+            {
+                sibling->Red = true;
+                region = parent;
+                parent = region->Parent;
+            }
+            else
+            {
+                if (sibling->Left == nullptr || !sibling->Left->Red)
+                {
+                    sibling->Right->Red = false;
+                    sibling->Red = true;
+                    RotateLeft(sibling);
+                    sibling = parent->Left;
+                }
+
+                sibling->Red = parent->Red;
+                parent->Red = false;
+                sibling->Left->Red = false;
+                RotateRight(parent);
+                region = m_Root;
+            }
+        }
+    }
+
+    if (region != nullptr)
+        region->Red = false;
+}
+
+void BSTAllocator::RotateLeft(BSTRegion* region)
+{
+    BSTRegion* right = region->Right;
+
+    region->Right = right->Left;
+    if (right->Left != nullptr)
+        right->Left->Parent = region;
+
+    ReplaceRegionWith(region, right);
+    right->Left = region;
+    region->Parent = right;
+
+    UpdateMaxFree(region);
+    UpdateMaxFree(right);
+}
+
+void BSTAllocator::RotateRight(BSTRegion* region)
+{
+    BSTRegion* left = region->Left;
+
+    region->Left = left->Right;
+    if (left->Right != nullptr)
+        left->Right->Parent = region;
+
+    ReplaceRegionWith(region, left);
+    left->Right = region;
+    region->Parent = left;
+
+    UpdateMaxFree(region);
+    UpdateMaxFree(left);
+}
+
+void BSTAllocator::UpdateMaxFree(BSTRegion* region)
+{
+    uint64_t maxFree = (region->Type == RegionType::Free) ? region->Size : 0;
+
+    if (region->Left != nullptr && region->Left->MaxFree > maxFree)
+        maxFree = region->Left->MaxFree;
+
+    if (region->Right != nullptr && region->Right->MaxFree > maxFree)
+        maxFree = region->Right->MaxFree;
+
+    region->MaxFree = maxFree;
+}
+
+void BSTAllocator::UpdateMaxFreeToRoot(BSTRegion* region)
+{
+    for (; region != nullptr; region = region->Parent)
+        UpdateMaxFree(region);
 }
 
 void BSTAllocator::ReplaceRegionWith(BSTRegion* region, BSTRegion* replaceWith)
@@ -357,6 +762,8 @@ void BSTAllocator::DumpImpl(JsonWriter& writer)
         writer.Property("parent", current->Parent);
         writer.Property("left", current->Left);
         writer.Property("right", current->Right);
+        writer.Property("red", current->Red);
+        writer.Property("maxFree", current->MaxFree);
         writer.Property("base", current->Base);
         writer.Property("size", current->Size);
         writer.Property("type", static_cast<int>(current->Type));
@@ -2,6 +2,9 @@
 
 #define STATIC_POOL_SIZE 256
 
+// free regions always kept around for the allocator's own allocations
+#define POOL_RESERVE_ELEMENTS 4
+
 struct BSTRegion
 {
     uint64_t Base;
@@ -10,6 +13,8 @@ struct BSTRegion
     BSTRegion* Parent;
     BSTRegion* Left;
     BSTRegion* Right;
+    uint64_t MaxFree;           // size of the biggest free region in this subtree
+    bool Red;
     bool BlockUsed;
 
     void Clear();
@@ -35,6 +40,16 @@ public:
     BSTAllocator();
     ptr_t Allocate(uint32_t blocks = 1) override;
     void Free(void* base, uint32_t blocks) override;
+    void Maintain() override;
+
+    // Frees a batch of regions sorted by address; each one is looked for among the few regions
+    // after the previous one before searching from the root, and neighbours merge as it goes.
+    void FreeSorted(const ptr_t bases[], size_t count);
+
+    // Pools are refilled in Maintain() when there are less than 'low' free regions, up to
+    // 'high' free regions; Allocate and Free don't grow or shrink them anymore, unless the
+    // pools are about to run out. low = 0 goes back to growing and shrinking inline.
+    void SetPoolWatermarks(uint64_t low, uint64_t high);
     
     // for statistics
     RegionType GetState(ptr_t address) override;
@@ -46,17 +61,30 @@ protected:
     
 private:
     ptr_t AllocateInternal(uint32_t blocks, RegionType type);
+    void FreeInternal(uint64_t base);
+    BSTRegion* FindRegion(uint64_t base);
+    BSTRegion* FreeRegion(BSTRegion* region);      // returns the merged region
     BSTRegion* FindFreeRegion(BSTRegion* root, size_t blocks);
 
     // Pool management
     BSTRegion* NewRegion();
     void ReleaseRegion(BSTRegion* region);
-    void GrowPool();
+    bool GrowPool();        // returns false if there is no memory left for another pool
+    void ShrinkPool();
+    void AddPoolRegions(BSTRegionPool* pool);
+    inline uint64_t FreePoolRegions() const { return m_TotalCapacity - m_UsedElements; }
+    void MoveRegion(BSTRegion* region);
 
-    // Binary search tree operations
+    // Binary search tree operations; the tree is kept balanced as a red-black tree
     void InsertRegion(BSTRegion* region);
     void DeleteRegion(BSTRegion* region);
     void ReplaceRegionWith(BSTRegion* region, BSTRegion* replaceWith);
+    void InsertFixup(BSTRegion* region);
+    void DeleteFixup(BSTRegion* region, BSTRegion* parent);
+    void RotateLeft(BSTRegion* region);
+    void RotateRight(BSTRegion* region);
+    void UpdateMaxFree(BSTRegion* region);
+    void UpdateMaxFreeToRoot(BSTRegion* region);
     
     inline void DeleteAndReleaseRegion(BSTRegion* region)
     {
@@ -72,9 +100,10 @@ private:
 
     uint64_t m_TotalCapacity;
     uint64_t m_UsedElements;
+    uint64_t m_PoolLowWatermark;
+    uint64_t m_PoolHighWatermark;
 
     BSTRegionPool m_FirstPool;
     BSTRegion m_StaticRegionPool[STATIC_POOL_SIZE];
-    BSTRegionPool* m_CurrentPool;
-    uint32_t m_CurrentPoolNextFree;
+    BSTRegion* m_FreeRegions;       // unused regions, linked through 'Right'
 };
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include "DualBBSTAllocator.hpp"
 #include <algorithm>
+#include <cassert>
 #include <math/MathHelpers.hpp>
 #include <util/JsonWriter.hpp>
+#include <Debug.hpp>
 
 DualBBSTRegion::DualBBSTRegion(uint64_t base,
                              uint64_t size,
@@ -14,98 +16,175 @@ DualBBSTRegion::DualBBSTRegion(uint64_t base,
 
 DualBBSTAllocator::DualBBSTAllocator()
     : Allocator(),
-      m_FreeMap(),
-      m_ReservedMap()
+      m_Nodes(),
+      m_FreeMap(&m_Nodes),
+      m_FreeSizeMap(&m_Nodes),
+      m_ReservedMap(&m_Nodes)
 {
 }
 
 bool DualBBSTAllocator::InitializeImpl(RegionBlocks regions[], size_t regionCount)
 {
+    // 2 nodes for every free region (address and size), 1 for every other region, 1 for
+    // splitting off the node blocks, and the reserve
+    uint64_t nodes = 1 + NODE_POOL_RESERVE;
+    for (size_t i = 0; i < regionCount; i++)
+        nodes += (regions[i].Type == RegionType::Free) ? 2 : 1;
+
+    uint64_t nodeBlocks = 0;
+    if (nodes > m_Nodes.FreeNodes())
+        nodeBlocks = DivRoundUp<uint64_t>((nodes - m_Nodes.FreeNodes()) * NODE_POOL_NODE_SIZE, m_BlockSize);
+
+    // the nodes which don't fit in the static pool are taken from a free region
+    RegionBlocks* nodeRegion = nullptr;
+    if (nodeBlocks > 0)
+    {
+        for (size_t i = 0; i < regionCount; i++)
+        {
+            if (regions[i].Type == RegionType::Free && regions[i].Size >= nodeBlocks)
+                nodeRegion = &regions[i];
+        }
+
+        if (nodeRegion == nullptr)
+        {
+            Debug::Error("DualBBSTAllocator", "Not enough free memory - needed %u blocks!", nodeBlocks);
+            return false;
+        }
+
+        m_Nodes.AddNodes(ToPtr(nodeRegion->Base), nodeBlocks * m_BlockSize);
+    }
+
     // Initially add all the regions to the "reseved" map
     for (size_t i = 0; i < regionCount; i++)
     {
         uint64_t base = regions[i].Base;
         uint64_t size = regions[i].Size;
 
-        if (regions[i].Type == RegionType::Free)
-            m_FreeMap.emplace(base, DualBBSTRegion(base, size, regions[i].Type));
+        if (&regions[i] == nodeRegion)
+        {
+            m_ReservedMap->emplace(base, DualBBSTRegion(base, nodeBlocks, RegionType::Allocator));
+            if (size > nodeBlocks)
+                AddFreeRegion(base + nodeBlocks, size - nodeBlocks);
+        }
+        else if (regions[i].Type == RegionType::Free)
+            AddFreeRegion(base, size);
         else
-            m_ReservedMap.emplace(base, DualBBSTRegion(base, size, regions[i].Type));
+            m_ReservedMap->emplace(base, DualBBSTRegion(base, size, regions[i].Type));
     }
 
     return true;
 }
 
 ptr_t DualBBSTAllocator::Allocate(uint32_t blocks)
+{
+    ptr_t ret = AllocateInternal(blocks, RegionType::Reserved);
+
+    // keep enough nodes for the next operation
+    if (m_Nodes.FreeNodes() < NODE_POOL_RESERVE)
+        GrowNodes();
+
+    return ret;
+}
+
+ptr_t DualBBSTAllocator::AllocateInternal(uint32_t blocks, RegionType type)
 {
     if (blocks == 0)
         return nullptr;
 
-    for (auto it = m_FreeMap.begin(); it != m_FreeMap.end(); it++)
-    {
-        if (it->second.Size >= blocks)
-        {
-            ptr_t ret = ToPtr(it->second.Base);
-
-            DualBBSTRegion block = it->second;
-            m_FreeMap.erase(it);
-            m_ReservedMap.emplace(block.Base, DualBBSTRegion(block.Base, blocks, RegionType::Reserved));
-
-            if (block.Size > blocks)
-            {
-                block.Base += blocks;
-                block.Size -= blocks;
-                m_FreeMap.emplace(block.Base, block);
-            }
-            
-            return ret;
-        }
-    }
+    // best fit: smallest region that is big enough, lowest address among equal sizes
+    auto sizeIt = m_FreeSizeMap->lower_bound(FreeSizeKey(blocks, 0));
+    if (sizeIt == m_FreeSizeMap->end())
+        return nullptr;
+
+    uint64_t base = sizeIt->second;
+    uint64_t size = sizeIt->first;
+
+    // splitting takes a node; only growing the pool can go below the minimum
+    if (size > blocks && m_Nodes.FreeNodes() < ((type == RegionType::Allocator) ? 1 : 1 + NODE_POOL_MIN_FREE))
+        return nullptr;
 
-    return nullptr;
+    RemoveFreeRegion(m_FreeMap->find(base));
+
+    m_ReservedMap->emplace(base, DualBBSTRegion(base, blocks, type));
+    if (size > blocks)
+        AddFreeRegion(base + blocks, size - blocks);
+
+    return ToPtr(base);
 }
 
 void DualBBSTAllocator::Free(void* basePtr, uint32_t blocks)
 {
     uint64_t base = ToBlock(basePtr);
 
-    // Find node
-    auto it = m_ReservedMap.find(base);
-    if (it == m_ReservedMap.end())
+    // Find node; the regions holding the allocator's nodes can't be freed
+    auto it = m_ReservedMap->find(base);
+    if (it == m_ReservedMap->end() || it->second.Type != RegionType::Reserved)
         return;
 
-    // Remove from reserved map, add to free map
-    DualBBSTRegion block = it->second;
-    m_ReservedMap.erase(it);
+    // without merging, 1 reserved node becomes 2 free nodes; allocations always leave
+    // enough for this, and the pool is grown right after
+    if (m_Nodes.FreeNodes() < 1)
+    {
+        GrowNodes();
 
-    block.Type = RegionType::Free;
-    auto freeIt = m_FreeMap.emplace(block.Base, block);
+        // out of memory for nodes; the region stays reserved
+        assert(m_Nodes.FreeNodes() >= 1);
+        if (m_Nodes.FreeNodes() < 1)
+            return;
+    }
 
-	// Can we merge with predecessor?
-	for (auto predIt = m_FreeMap.begin(); predIt != m_FreeMap.end(); predIt++)
-	{
-		if (predIt->second.Base <= freeIt->second.Base && predIt->second.Base + predIt->second.Size >= freeIt->second.Base)
-		{
-			auto predBase = predIt->second.Base;
-			predIt->second.Size += freeIt->second.Size;
-			m_FreeMap.erase(freeIt);
-
-			// iterators are invalidated, so restore them
-			freeIt = m_FreeMap.find(predBase);
-			break;
-		}
-	}
+    // Remove from reserved map
+    uint64_t size = it->second.Size;
+    m_ReservedMap->erase(it);
+
+    // the neighbours are right around 'base' in the address tree
+    auto nextIt = m_FreeMap->lower_bound(base);
 
 	// Can we merge with successor?
-	for (auto succIt = m_FreeMap.begin(); succIt != m_FreeMap.end(); succIt++)
-	{
-		if (freeIt->second.Base <= succIt->second.Base && freeIt->second.Base + freeIt->second.Size >= succIt->second.Base)
-		{
-			freeIt->second.Size += succIt->second.Size;
-			m_FreeMap.erase(succIt);
-			break;
-		}
-	}
+    if (nextIt != m_FreeMap->end() && base + size == nextIt->second.Base)
+    {
+        size += nextIt->second.Size;
+        auto afterIt = std::next(nextIt);
+        RemoveFreeRegion(nextIt);
+        nextIt = afterIt;
+    }
+
+	// Can we merge with predecessor?
+    if (nextIt != m_FreeMap->begin())
+    {
+        auto prevIt = std::prev(nextIt);
+        if (prevIt->second.Base + prevIt->second.Size == base)
+        {
+            base = prevIt->second.Base;
+            size += prevIt->second.Size;
+            RemoveFreeRegion(prevIt);
+        }
+    }
+
+    AddFreeRegion(base, size);
+
+    // freeing can take a node too (1 reserved node becomes 2 free nodes)
+    if (m_Nodes.FreeNodes() < NODE_POOL_RESERVE)
+        GrowNodes();
+}
+
+void DualBBSTAllocator::GrowNodes()
+{
+    ptr_t memory = AllocateInternal(1, RegionType::Allocator);
+    if (memory != nullptr)
+        m_Nodes.AddNodes(memory, m_BlockSize);
+}
+
+void DualBBSTAllocator::AddFreeRegion(uint64_t base, uint64_t size)
+{
+    m_FreeMap->emplace(base, DualBBSTRegion(base, size, RegionType::Free));
+    m_FreeSizeMap->emplace(size, base);
+}
+
+void DualBBSTAllocator::RemoveFreeRegion(std::pmr::map<uint64_t, DualBBSTRegion>::iterator it)
+{
+    m_FreeSizeMap->erase(FreeSizeKey(it->second.Size, it->second.Base));
+    m_FreeMap->erase(it);
 }
 
 // for statistics
@@ -113,16 +192,16 @@ RegionType DualBBSTAllocator::GetState(ptr_t address)
 {
     uint64_t block = ToBlock(address);
 
-    auto it = m_ReservedMap.upper_bound(block);     // returns iterator to first element GREATER than 'block'
-    if (it != m_ReservedMap.begin())
+    auto it = m_ReservedMap->upper_bound(block);     // returns iterator to first element GREATER than 'block'
+    if (it != m_ReservedMap->begin())
     {
         --it;
         if (block >= it->second.Base && block < it->second.Base + it->second.Size)
             return it->second.Type;
     }
 
-    it = m_FreeMap.upper_bound(block);             // returns iterator to first element GREATER than 'block'
-    if (it != m_FreeMap.begin())
+    it = m_FreeMap->upper_bound(block);             // returns iterator to first element GREATER than 'block'
+    if (it != m_FreeMap->begin())
     {
         --it;
         if (block >= it->second.Base && block < it->second.Base + it->second.Size)
@@ -137,7 +216,7 @@ void DualBBSTAllocator::DumpImpl(JsonWriter& writer)
 {
     writer.BeginArray("freeMap");
 
-    for (auto& pair : m_FreeMap)
+    for (auto& pair : *m_FreeMap)
     {
         writer.BeginObject();
         writer.Property("base", pair.second.Base);
@@ -149,7 +228,7 @@ void DualBBSTAllocator::DumpImpl(JsonWriter& writer)
     writer.EndArray();
     writer.BeginArray("reservedMap");
 
-    for (auto& pair : m_ReservedMap)
+    for (auto& pair : *m_ReservedMap)
     {
         writer.BeginObject();
         writer.Property("base", pair.second.Base);
@@ -163,8 +242,11 @@ void DualBBSTAllocator::DumpImpl(JsonWriter& writer)
 
 uint64_t DualBBSTAllocator::MeasureWastedMemory()
 {
-    // not accurate
-    size_t freeSize = sizeof(m_FreeMap) + m_FreeMap.size() * sizeof(std::multimap<uint64_t, DualBBSTRegion>::node_type); // NOLINT(bugprone-sizeof-container)
-    size_t usedSize = sizeof(m_ReservedMap) + m_ReservedMap.size() * sizeof(std::multimap<uint64_t, DualBBSTRegion>::node_type); // NOLINT(bugprone-sizeof-container)
-    return DivRoundUp(sizeof(*this) + freeSize + usedSize, m_BlockSize);
+    uint64_t total = DivRoundUp(sizeof(*this), m_BlockSize);
+    for (auto& pair : *m_ReservedMap)
+    {
+        if (pair.second.Type == RegionType::Allocator)
+            total += pair.second.Size;
+    }
+    return total;
 }
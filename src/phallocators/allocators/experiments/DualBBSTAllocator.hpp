@@ -1,5 +1,7 @@
 #include "../Allocator.hpp"
+#include "../../util/NodePoolResource.hpp"
 #include <map>
+#include <set>
 
 struct DualBBSTRegion
 {
@@ -14,7 +16,10 @@ struct DualBBSTRegion
 
 /**
  * Balanced Binary Search Tree allocator
- * (not suitable for an OS because it uses std::map, std::multimap)
+ *
+ * Free regions are in 2 trees: one sorted by address (for finding the neighbours
+ * when merging) and one sorted by size (for best fit). The tree nodes come from
+ * blocks taken from the managed memory (marked as RegionType::Allocator).
  */
 class DualBBSTAllocator : public Allocator
 {
@@ -32,6 +37,15 @@ protected:
     void DumpImpl(JsonWriter& writer) override;
 
 private:
-    std::multimap<uint64_t, DualBBSTRegion> m_FreeMap;
-    std::map<uint64_t, DualBBSTRegion> m_ReservedMap;
+    using FreeSizeKey = std::pair<uint64_t, uint64_t>;      // size, base
+
+    ptr_t AllocateInternal(uint32_t blocks, RegionType type);
+    void GrowNodes();
+    void AddFreeRegion(uint64_t base, uint64_t size);
+    void RemoveFreeRegion(std::pmr::map<uint64_t, DualBBSTRegion>::iterator it);
+
+    NodePoolResource m_Nodes;
+    NoDestructor<std::pmr::map<uint64_t, DualBBSTRegion>> m_FreeMap;
+    NoDestructor<std::pmr::set<FreeSizeKey>> m_FreeSizeMap;
+    NoDestructor<std::pmr::map<uint64_t, DualBBSTRegion>> m_ReservedMap;
 };
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "BitScan.hpp"
+#include "MathHelpers.hpp"
+#include <memory.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#   include <immintrin.h>
+#endif
+
+uint64_t FindFirstNotEqualScalar(const uint8_t* data, uint64_t start, uint64_t end, uint8_t value)
+{
+    uint64_t pattern = 0x0101010101010101ull * value;
+    uint64_t i = start;
+
+    // entire words
+    for (; i + sizeof(uint64_t) <= end; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != pattern)
+            break;
+    }
+
+    // find the exact byte
+    for (; i < end; i++)
+    {
+        if (data[i] != value)
+            return i;
+    }
+
+    return end;
+}
+
+uint64_t FindFirstNotEqual(const uint8_t* data, uint64_t start, uint64_t end, uint8_t value)
+{
+    uint64_t i = start;
+
+#if defined(__AVX2__)
+    // 256 bits at a time
+    __m256i pattern = _mm256_set1_epi8(static_cast<char>(value));
+    for (; i + sizeof(__m256i) <= end; i += sizeof(__m256i))
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        uint32_t equal = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)));
+        if (equal != 0xFFFFFFFFu)
+            return i + CountTrailingZeros(~equal);
+    }
+#elif defined(__SSE2__)
+    // 128 bits at a time
+    __m128i pattern = _mm_set1_epi8(static_cast<char>(value));
+    for (; i + sizeof(__m128i) <= end; i += sizeof(__m128i))
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        uint32_t equal = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)));
+        if (equal != 0xFFFFu)
+            return i + CountTrailingZeros(~equal);
+    }
+#endif
+
+    // whatever is left
+    return FindFirstNotEqualScalar(data, i, end, value);
+}
+
+const char* BitScanKernelName()
+{
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
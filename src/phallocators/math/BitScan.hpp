@@ -0,0 +1,116 @@
+#pragma once
+#include <cstdint>
+#include <memory.h>
+#include "MathHelpers.hpp"
+
+#if defined(__BMI2__)
+#   include <immintrin.h>
+#endif
+
+/**
+ * Bitmap scanning kernels.
+ * 
+ * These look for the first byte in the range [start, end) which is different than 'value',
+ * and return its index (or 'end' if all the bytes are equal to 'value'). Used for quickly
+ * skipping over runs of fully used (0xFF) or fully free (0x00) bitmap units.
+ */
+
+// Best kernel available, selected at build time (AVX2, SSE2 or scalar)
+uint64_t FindFirstNotEqual(const uint8_t* data, uint64_t start, uint64_t end, uint8_t value);
+
+// Scalar fallback, compares 1 word at a time
+uint64_t FindFirstNotEqualScalar(const uint8_t* data, uint64_t start, uint64_t end, uint8_t value);
+
+// Name of the kernel picked by FindFirstNotEqual
+const char* BitScanKernelName();
+
+
+/**
+ * Bit-parallel run detection inside a single word (up to 64 bits).
+ */
+
+// Number of consecutive 0 bits at the top of 'word' (word must not be 0)
+template<typename T>
+inline unsigned CountTopZeroBits(T word)
+{
+    return __builtin_clzll(static_cast<uint64_t>(word)) - (64 - 8 * sizeof(T));
+}
+
+// Index of the first run of 'count' consecutive set bits in 'word', or -1 if there is none
+template<typename T>
+inline int FindSetBitRun(T word, unsigned count)
+{
+    // after each step, bit 'i' is set if bits [i, i + length) were all set
+    for (unsigned length = 1; length < count && word != 0; )
+    {
+        unsigned shift = (length < count - length) ? length : count - length;
+        word &= word >> shift;
+        length += shift;
+    }
+
+    return (word != 0) ? static_cast<int>(CountTrailingZeros(word)) : -1;
+}
+
+// Bit 'i' of the result is set if bit 2i or bit 2i+1 of 'word' is set, portable version
+inline uint32_t OrCompressPairsScalar(uint64_t word)
+{
+    // OR the pairs into the even bits, then squeeze the even bits together
+    word = (word | (word >> 1)) & 0x5555555555555555ull;
+    word = (word | (word >> 1)) & 0x3333333333333333ull;
+    word = (word | (word >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+    word = (word | (word >> 4)) & 0x00FF00FF00FF00FFull;
+    word = (word | (word >> 8)) & 0x0000FFFF0000FFFFull;
+    word = (word | (word >> 16)) & 0x00000000FFFFFFFFull;
+    return static_cast<uint32_t>(word);
+}
+
+// Bit 'i' of the result is set if bit 2i or bit 2i+1 of 'word' is set
+inline uint32_t OrCompressPairs(uint64_t word)
+{
+#if defined(__BMI2__)
+    return static_cast<uint32_t>(_pext_u64(word | (word >> 1), 0x5555555555555555ull));
+#else
+    return OrCompressPairsScalar(word);
+#endif
+}
+
+
+/**
+ * Bitmap marking
+ */
+
+// Sets (value = true) or clears the bits [first, first + count) of a bitmap made of TUnit words
+template<typename TUnit>
+inline void FillBits(TUnit* bitmap, uint64_t first, uint64_t count, bool value)
+{
+    constexpr uint64_t BitsPerUnit = sizeof(TUnit) * 8;
+    constexpr TUnit FullUnit = static_cast<TUnit>(-1);
+
+    if (count == 0)
+        return;
+
+    uint64_t unit = first / BitsPerUnit;
+    uint64_t lastUnit = (first + count - 1) / BitsPerUnit;
+    auto headMask = static_cast<TUnit>(FullUnit << (first % BitsPerUnit));
+    auto tailMask = static_cast<TUnit>(FullUnit >> (BitsPerUnit - 1 - (first + count - 1) % BitsPerUnit));
+
+    // everything is in the same unit
+    if (unit == lastUnit)
+        headMask &= tailMask;
+
+    if (value)
+        bitmap[unit] |= headMask;
+    else
+        bitmap[unit] &= static_cast<TUnit>(~headMask);
+
+    if (unit == lastUnit)
+        return;
+
+    // entire units in the middle
+    memset(bitmap + unit + 1, value ? 0xFF : 0, (lastUnit - unit - 1) * sizeof(TUnit));
+
+    if (value)
+        bitmap[lastUnit] |= tailMask;
+    else
+        bitmap[lastUnit] &= static_cast<TUnit>(~tailMask);
+}
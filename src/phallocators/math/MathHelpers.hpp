@@ -5,9 +5,11 @@
 #ifdef __cpp_lib_bitops
 #   include <bit>
 #   define CountLeadingZeros(x) std::countl_zero(x)
+#   define CountTrailingZeros(x) std::countr_zero(x)
 #else
-	// no - use compiler builtin clz function
+	// no - use compiler builtin clz/ctz functions
 #   define CountLeadingZeros(x) __builtin_clz(x)
+#   define CountTrailingZeros(x) __builtin_ctzll(x)
 #endif
 
 uint32_t RoundToPowerOf2(uint32_t x);
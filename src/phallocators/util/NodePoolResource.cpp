@@ -0,0 +1,52 @@
+#include "NodePoolResource.hpp"
+#include <cassert>
+
+NodePoolResource::NodePoolResource()
+    : m_FreeNodes(nullptr),
+      m_FreeNodeCount(0),
+      m_UsedNodeCount(0)
+{
+    AddNodes(m_StaticNodes, sizeof(m_StaticNodes));
+}
+
+void NodePoolResource::AddNodes(void* memory, size_t sizeBytes)
+{
+    auto* u8Memory = reinterpret_cast<uint8_t*>(memory);
+
+    // add in reverse, so the nodes are handed out in order
+    for (size_t i = sizeBytes / NODE_POOL_NODE_SIZE; i > 0; i--)
+    {
+        auto* node = reinterpret_cast<FreeNode*>(u8Memory + (i - 1) * NODE_POOL_NODE_SIZE);
+        node->Next = m_FreeNodes;
+        m_FreeNodes = node;
+        m_FreeNodeCount++;
+    }
+}
+
+void* NodePoolResource::do_allocate(size_t bytes, size_t alignment)
+{
+    assert(bytes <= NODE_POOL_NODE_SIZE && alignment <= alignof(std::max_align_t));
+
+    // the owner makes sure there are enough nodes before touching the containers
+    assert(m_FreeNodes != nullptr);
+
+    FreeNode* node = m_FreeNodes;
+    m_FreeNodes = node->Next;
+    m_FreeNodeCount--;
+    m_UsedNodeCount++;
+    return node;
+}
+
+void NodePoolResource::do_deallocate(void* p, size_t bytes, size_t alignment)
+{
+    auto* node = reinterpret_cast<FreeNode*>(p);
+    node->Next = m_FreeNodes;
+    m_FreeNodes = node;
+    m_FreeNodeCount++;
+    m_UsedNodeCount--;
+}
+
+bool NodePoolResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+    return this == &other;
+}
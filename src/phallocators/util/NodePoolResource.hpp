@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory_resource>
+#include <utility>
+
+#define NODE_POOL_NODE_SIZE     64
+#define NODE_POOL_STATIC_SIZE   256
+
+// free nodes to keep around, so a single allocate or free never runs out
+#define NODE_POOL_RESERVE       8
+
+// free nodes an allocation never goes below, so a Free and growing the pool can't run out
+#define NODE_POOL_MIN_FREE      2
+
+/**
+ * Memory resource for node based containers (std::pmr::map, std::pmr::set), which hands
+ * out fixed size nodes from memory given to it, instead of going to the heap.
+ *
+ * The first NODE_POOL_STATIC_SIZE nodes are inside the resource; more memory is added
+ * through AddNodes. Nothing is thrown when the nodes run out (the containers can't be
+ * told about it any other way), so the owner has to check FreeNodes() before every
+ * operation, and fail the operation if there aren't enough.
+ */
+class NodePoolResource : public std::pmr::memory_resource
+{
+public:
+    NodePoolResource();
+
+    // adds the memory to the pool of free nodes
+    void AddNodes(void* memory, size_t sizeBytes);
+
+    inline uint64_t FreeNodes() const { return m_FreeNodeCount; }
+    inline uint64_t UsedNodes() const { return m_UsedNodeCount; }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+private:
+    struct FreeNode
+    {
+        FreeNode* Next;
+    };
+
+    FreeNode* m_FreeNodes;
+    uint64_t m_FreeNodeCount;
+    uint64_t m_UsedNodeCount;
+
+    alignas(alignof(std::max_align_t)) uint8_t m_StaticNodes[NODE_POOL_STATIC_SIZE * NODE_POOL_NODE_SIZE];
+};
+
+
+/**
+ * Holds a container whose nodes come from a NodePoolResource, without ever destroying it.
+ * The nodes are in the managed memory, which can be gone by the time the allocator is
+ * destroyed, so the container must not walk them in its destructor.
+ */
+template<typename T>
+class NoDestructor
+{
+public:
+    template<typename... Args>
+    NoDestructor(Args&&... args)
+        : m_Value(std::forward<Args>(args)...)
+    {
+    }
+
+    ~NoDestructor() { }
+
+    inline T* operator->() { return &m_Value; }
+    inline T& operator*() { return m_Value; }
+
+private:
+    union
+    {
+        T m_Value;
+    };
+};
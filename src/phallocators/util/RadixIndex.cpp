@@ -0,0 +1,164 @@
+#include "RadixIndex.hpp"
+#include <memory.h>
+
+RadixIndex::RadixIndex()
+    : m_Root(nullptr),
+      m_Levels(1),
+      m_FreeNodes(nullptr),
+      m_FreeNodeCount(0)
+{
+}
+
+void RadixIndex::Initialize(uint64_t maxKey)
+{
+    m_Root = nullptr;
+    m_FreeNodes = nullptr;
+    m_FreeNodeCount = 0;
+
+    m_Levels = 1;
+    while (m_Levels * RADIX_INDEX_BITS < 64 && (maxKey >> (m_Levels * RADIX_INDEX_BITS)) != 0)
+        m_Levels++;
+}
+
+void RadixIndex::AddNodes(void* memory, size_t sizeBytes)
+{
+    auto* nodes = reinterpret_cast<RadixIndexNode*>(memory);
+    for (size_t i = 0; i < sizeBytes / sizeof(RadixIndexNode); i++)
+        ReleaseNode(&nodes[i]);
+}
+
+RadixIndexNode* RadixIndex::NewNode()
+{
+    RadixIndexNode* node = m_FreeNodes;
+    m_FreeNodes = reinterpret_cast<RadixIndexNode*>(node->Children[0]);
+    m_FreeNodeCount--;
+
+    memset(node, 0, sizeof(RadixIndexNode));
+    return node;
+}
+
+void RadixIndex::ReleaseNode(RadixIndexNode* node)
+{
+    node->Children[0] = m_FreeNodes;
+    m_FreeNodes = node;
+    m_FreeNodeCount++;
+}
+
+bool RadixIndex::Insert(uint64_t key, void* value)
+{
+    if (m_FreeNodeCount < static_cast<uint64_t>(m_Levels))
+        return false;
+
+    if (m_Root == nullptr)
+        m_Root = NewNode();
+
+    RadixIndexNode* node = m_Root;
+    for (int level = m_Levels - 1; level > 0; level--)
+    {
+        unsigned digit = Digit(key, level);
+        if ((node->Mask & (1ull << digit)) == 0)
+        {
+            node->Children[digit] = NewNode();
+            node->Mask |= (1ull << digit);
+        }
+
+        node = reinterpret_cast<RadixIndexNode*>(node->Children[digit]);
+    }
+
+    unsigned digit = Digit(key, 0);
+    node->Children[digit] = value;
+    node->Mask |= (1ull << digit);
+    return true;
+}
+
+void RadixIndex::Remove(uint64_t key)
+{
+    RadixIndexNode* path[64 / RADIX_INDEX_BITS + 1];
+
+    RadixIndexNode* node = m_Root;
+    for (int level = m_Levels - 1; level >= 0; level--)
+    {
+        if (node == nullptr || (node->Mask & (1ull << Digit(key, level))) == 0)
+            return; // not found
+
+        path[level] = node;
+        if (level > 0)
+            node = reinterpret_cast<RadixIndexNode*>(node->Children[Digit(key, level)]);
+    }
+
+    // clear the key, and release the nodes that became empty
+    for (int level = 0; level < m_Levels; level++)
+    {
+        path[level]->Mask &= ~(1ull << Digit(key, level));
+        if (path[level]->Mask != 0)
+            return;
+
+        ReleaseNode(path[level]);
+    }
+
+    m_Root = nullptr;
+}
+
+void* RadixIndex::Find(uint64_t key)
+{
+    RadixIndexNode* node = m_Root;
+    for (int level = m_Levels - 1; level >= 0; level--)
+    {
+        if (node == nullptr || (node->Mask & (1ull << Digit(key, level))) == 0)
+            return nullptr;
+
+        if (level == 0)
+            return node->Children[Digit(key, 0)];
+
+        node = reinterpret_cast<RadixIndexNode*>(node->Children[Digit(key, level)]);
+    }
+
+    return nullptr;
+}
+
+void* RadixIndex::FindPredecessor(uint64_t key)
+{
+    if (m_Root == nullptr)
+        return nullptr;
+
+    // keys bigger than what the tree can hold
+    if (m_Levels * RADIX_INDEX_BITS < 64 && (key >> (m_Levels * RADIX_INDEX_BITS)) != 0)
+        return FindMax(m_Root, m_Levels - 1);
+
+    return FindPredecessor(m_Root, m_Levels - 1, key);
+}
+
+void* RadixIndex::FindPredecessor(RadixIndexNode* node, int level, uint64_t key)
+{
+    unsigned digit = Digit(key, level);
+
+    // same digit as the key
+    if (node->Mask & (1ull << digit))
+    {
+        if (level == 0)
+            return node->Children[digit];
+
+        void* value = FindPredecessor(reinterpret_cast<RadixIndexNode*>(node->Children[digit]), level - 1, key);
+        if (value != nullptr)
+            return value;
+    }
+
+    // biggest key in the closest smaller subtree
+    uint64_t smaller = node->Mask & ((1ull << digit) - 1);
+    if (smaller == 0)
+        return nullptr;
+
+    unsigned child = 63 - __builtin_clzll(smaller);
+    if (level == 0)
+        return node->Children[child];
+
+    return FindMax(reinterpret_cast<RadixIndexNode*>(node->Children[child]), level - 1);
+}
+
+void* RadixIndex::FindMax(RadixIndexNode* node, int level)
+{
+    for (; level > 0; level--)
+        node = reinterpret_cast<RadixIndexNode*>(node->Children[63 - __builtin_clzll(node->Mask)]);
+
+    return node->Children[63 - __builtin_clzll(node->Mask)];
+}
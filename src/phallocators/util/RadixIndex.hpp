@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+#define RADIX_INDEX_BITS        6
+#define RADIX_INDEX_FANOUT      (1 << RADIX_INDEX_BITS)
+
+struct RadixIndexNode
+{
+    uint64_t Mask;                                  // which children are present
+    void* Children[RADIX_INDEX_FANOUT];             // nodes, or values on the last level
+};
+
+/**
+ * Radix tree which maps integer keys to pointers, with 64 children per node.
+ * Supports exact lookups and looking up the greatest key smaller or equal to a
+ * given key, both in O(levels).
+ *
+ * The index doesn't allocate memory by itself; nodes are taken from memory given
+ * through AddNodes. An insert needs at most 'Levels()' free nodes.
+ */
+class RadixIndex
+{
+public:
+    RadixIndex();
+
+    // maxKey: biggest key that will be stored
+    void Initialize(uint64_t maxKey);
+
+    // adds the memory to the pool of free nodes
+    void AddNodes(void* memory, size_t sizeBytes);
+
+    // returns false if there were not enough free nodes
+    bool Insert(uint64_t key, void* value);
+    void Remove(uint64_t key);
+
+    void* Find(uint64_t key);
+
+    // value with the greatest key <= 'key', or nullptr
+    void* FindPredecessor(uint64_t key);
+
+    inline uint64_t FreeNodes() const { return m_FreeNodeCount; }
+    inline int Levels() const { return m_Levels; }
+
+private:
+    RadixIndexNode* NewNode();
+    void ReleaseNode(RadixIndexNode* node);
+
+    void* FindPredecessor(RadixIndexNode* node, int level, uint64_t key);
+    void* FindMax(RadixIndexNode* node, int level);
+
+    static inline unsigned Digit(uint64_t key, int level)
+    {
+        return (key >> (level * RADIX_INDEX_BITS)) & (RADIX_INDEX_FANOUT - 1);
+    }
+
+    RadixIndexNode* m_Root;
+    int m_Levels;
+
+    RadixIndexNode* m_FreeNodes;        // linked through Children[0]
+    uint64_t m_FreeNodeCount;
+};
@@ -0,0 +1,10 @@
+#include "ThreadIndex.hpp"
+#include <atomic>
+
+static std::atomic<uint32_t> s_NextThreadIndex(0);
+
+uint32_t CurrentThreadIndex()
+{
+    static thread_local uint32_t index = s_NextThreadIndex.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
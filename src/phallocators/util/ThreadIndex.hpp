@@ -0,0 +1,8 @@
+#pragma once
+#include <cstdint>
+
+/**
+ * Small number which identifies the calling thread, given out in the order in which
+ * threads first ask for it (0, 1, 2...). Used to pick per thread slots.
+ */
+uint32_t CurrentThreadIndex();
@@ -2,6 +2,8 @@
 #include <phallocators/allocators/Allocator.hpp>
 #include <Config.hpp>
 #include <Utils.hpp>
+#include <algorithm>
+#include <vector>
 
 inline int Increment(int i)
 {
@@ -45,12 +47,12 @@ TEMPLATE_TEST_CASE("Simple allocation test", "[allocation]", ALL_ALLOCATORS)
         REQUIRE(allocator.GetState(ptr + BLOCK_SIZE - 1) == RegionType::Free);
         REQUIRE(allocator.GetState(ptr + (i * BLOCK_SIZE) - 1) == RegionType::Free);
 
-        // ensure entire memory is free
-        for (uint64_t j = 0; j < MEM_SIZE; j += BLOCK_SIZE)
-        {
-            INFO(j);
-            REQUIRE(is_one_of(allocator.GetState(basePtr + j), RegionType::Free, RegionType::Allocator));
-        }
+        // ensure entire memory is free; one REQUIRE for the whole scan, otherwise catch2's
+        // bookkeeping dominates the test. On failure, j is the first block which isn't free
+        uint64_t j = 0;
+        while (j < MEM_SIZE && is_one_of(allocator.GetState(basePtr + j), RegionType::Free, RegionType::Allocator))
+            j += BLOCK_SIZE;
+        REQUIRE(j == MEM_SIZE);
     }
 
 
@@ -105,5 +107,78 @@ TEMPLATE_TEST_CASE("Allocation test with some initial regions", "[allocation]",
             REQUIRE(is_one_of(allocator.GetState(basePtr + i), RegionType::Free, RegionType::Allocator));
         }
 
+    delete[] basePtr;
+}
+
+TEMPLATE_TEST_CASE("Allocate all memory one block at a time", "[allocation][concurrent]", CONCURRENT_ALLOCATORS)
+{
+    TestType allocator;
+    uint8_t* basePtr = new uint8_t[MEM_SIZE];
+    Region regions[] = 
+    {
+        { basePtr + 0x00000000, 0x00000500, RegionType::Reserved },
+        { basePtr + 0x00000500, 0x0007FB00, RegionType::Free     },
+        { basePtr + 0x00080000, 0x00070000, RegionType::Reserved },
+        { basePtr + 0x000F0000, 0x00010000, RegionType::Reserved },
+        { basePtr + 0x00100000, MEM_SIZE - 0x00100000, RegionType::Free },
+    };
+
+    REQUIRE(allocator.Initialize(BLOCK_SIZE, regions, ArraySize(regions)));
+
+    // every free block should be reachable from one thread, wherever it is kept
+    std::vector<ptr_t> allocated;
+    for (ptr_t ptr = allocator.Allocate(1); ptr != nullptr; ptr = allocator.Allocate(1))
+        allocated.push_back(ptr);
+
+    for (uint64_t i = 0; i < MEM_SIZE; i += BLOCK_SIZE)
+    {
+        INFO(i);
+        REQUIRE(allocator.GetState(basePtr + i) != RegionType::Free);
+    }
+
+    for (ptr_t ptr : allocated)
+        allocator.Free(ptr, 1);
+
+    // ensure entire memory is free
+    for (uint64_t i = 0; i < MEM_SIZE; i += BLOCK_SIZE)
+        if ((i >= 0x1000 && i < 0x80000) || i >= 0x00100000)
+        {
+            INFO(i);
+            REQUIRE(is_one_of(allocator.GetState(basePtr + i), RegionType::Free, RegionType::Allocator));
+        }
+
+    delete[] basePtr;
+}
+
+TEMPLATE_TEST_CASE("Double free test", "[allocation][concurrent]", CONCURRENT_ALLOCATORS)
+{
+    TestType allocator;
+    uint8_t* basePtr = new uint8_t[MEM_SIZE];
+    Region regions[] = 
+    {
+        { basePtr + 0x00000000, MEM_SIZE, RegionType::Free },
+    };
+
+    REQUIRE(allocator.Initialize(BLOCK_SIZE, regions, ArraySize(regions)));
+
+    // freeing a block twice, or freeing a block which was never allocated, must not hand it out twice
+    ptr_t ptr = allocator.Allocate(1);
+    REQUIRE(ptr != nullptr);
+    allocator.Free(ptr, 1);
+    allocator.Free(ptr, 1);
+
+    ptr_t unallocated = basePtr + MEM_SIZE - BLOCK_SIZE;
+    allocator.Free(unallocated, 1);
+
+    std::vector<ptr_t> allocated;
+    for (ptr_t next = allocator.Allocate(1); next != nullptr; next = allocator.Allocate(1))
+        allocated.push_back(next);
+
+    std::sort(allocated.begin(), allocated.end());
+    REQUIRE(std::adjacent_find(allocated.begin(), allocated.end()) == allocated.end());
+
+    for (ptr_t next : allocated)
+        allocator.Free(next, 1);
+
     delete[] basePtr;
 }
\ No newline at end of file
@@ -7,23 +7,74 @@
 
 #include <phallocators/allocators/BitmapAllocator.hpp>
 #include <phallocators/allocators/BuddyAllocator.hpp>
+#include <phallocators/allocators/BuddyTreeAllocator.hpp>
 #include <phallocators/allocators/LinkedListAllocator.hpp>
+#include <phallocators/allocators/TLSFAllocator.hpp>
+#include <phallocators/allocators/CompactLinkedListAllocator.hpp>
+#include <phallocators/allocators/ConcurrentBitmapAllocator.hpp>
+#include <phallocators/allocators/PerCpuCache.hpp>
+#include <phallocators/allocators/ShardedAllocator.hpp>
+#include <phallocators/allocators/FlatCombining.hpp>
 #include <phallocators/allocators/experiments/BSTAllocator.hpp>
 #include <phallocators/allocators/experiments/BBSTAllocator.hpp>
 #include <phallocators/allocators/experiments/DualBBSTAllocator.hpp>
 
+// linked list allocator with the optional address index turned on
+class IndexedLinkedListAllocatorFirstFit : public LinkedListAllocatorFirstFit
+{
+public:
+    IndexedLinkedListAllocatorFirstFit()
+    {
+        SetAddressIndex(true);
+    }
+};
+
 #define ALL_ALLOCATORS          BitmapAllocatorFirstFit,        \
                                 BitmapAllocatorNextFit,         \
                                 BitmapAllocatorBestFit,         \
                                 BitmapAllocatorWorstFit,        \
                                 BuddyAllocator,                 \
+                                BuddyAllocatorFreeList,         \
+                                BuddyAllocator64K,              \
+                                BuddyAllocatorExact,            \
+                                BuddyAllocatorFreeListExact,    \
+                                BuddyTreeAllocator,             \
                                 LinkedListAllocatorFirstFit,    \
                                 LinkedListAllocatorNextFit,     \
                                 LinkedListAllocatorBestFit,     \
                                 LinkedListAllocatorWorstFit,    \
+                                IndexedLinkedListAllocatorFirstFit, \
+                                TLSFAllocator,                  \
+                                CompactLinkedListAllocatorFirstFit, \
+                                CompactLinkedListAllocatorBestFit, \
                                 BSTAllocator,                   \
                                 BBSTAllocator,                  \
+                                DualBBSTAllocator,              \
+                                ConcurrentBitmapAllocator,      \
+                                PerCpuCache<BitmapAllocatorFirstFit>, \
+                                PerCpuCache<BuddyAllocator>,    \
+                                PerCpuCache<LinkedListAllocatorFirstFit>, \
+                                FlatCombining<LinkedListAllocatorFirstFit>, \
+                                FlatCombining<BSTAllocator>,    \
+                                FlatCombining<DualBBSTAllocator>
+
+// sharded allocators can't allocate more than a shard at once, so they only run the concurrent tests
+using ContiguousShardedBitmapAllocator = ShardedAllocator<BitmapAllocatorFirstFit, 8, ShardPolicy::Contiguous>;
+using InterleavedShardedLinkedListAllocator = ShardedAllocator<LinkedListAllocatorFirstFit, 8, ShardPolicy::Interleaved>;
+
+// allocators which grow their node pools while initializing, so the memory map can have any number of regions
+#define LARGE_MAP_ALLOCATORS    CompactLinkedListAllocatorFirstFit, \
+                                CompactLinkedListAllocatorBestFit, \
+                                BBSTAllocator,                  \
                                 DualBBSTAllocator
 
-#undef ALL_ALLOCATORS
-#define ALL_ALLOCATORS BuddyAllocator
\ No newline at end of file
+// allocators which can be called from multiple threads
+#define CONCURRENT_ALLOCATORS   ConcurrentBitmapAllocator,      \
+                                PerCpuCache<BitmapAllocatorFirstFit>, \
+                                PerCpuCache<BuddyAllocator>,    \
+                                PerCpuCache<LinkedListAllocatorFirstFit>, \
+                                ContiguousShardedBitmapAllocator, \
+                                InterleavedShardedLinkedListAllocator, \
+                                FlatCombining<LinkedListAllocatorFirstFit>, \
+                                FlatCombining<BSTAllocator>,    \
+                                FlatCombining<DualBBSTAllocator>
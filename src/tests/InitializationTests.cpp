@@ -2,6 +2,7 @@
 #include <phallocators/allocators/Allocator.hpp>
 #include <Config.hpp>
 #include <Utils.hpp>
+#include <vector>
 
 TEMPLATE_TEST_CASE("Simple initialization test", "[initialization]", ALL_ALLOCATORS)
 {
@@ -88,3 +89,51 @@ TEMPLATE_TEST_CASE("Overlapping regions initialization test", "[initialization]"
 
     delete[] basePtr;
 }
+
+TEMPLATE_TEST_CASE("Large memory map initialization test", "[initialization]", LARGE_MAP_ALLOCATORS)
+{
+    TestType allocator;
+    uint8_t* basePtr = new uint8_t[MEM_SIZE];
+
+    // more regions than the static node pools can hold
+    const size_t smallRegions = 900;
+    const uint64_t smallRegionSize = 2 * BLOCK_SIZE;
+
+    std::vector<Region> regions;
+    for (size_t i = 0; i < smallRegions; i++)
+        regions.push_back({ basePtr + i * smallRegionSize, smallRegionSize, (i % 2 == 0) ? RegionType::Free : RegionType::Reserved });
+    regions.push_back({ basePtr + smallRegions * smallRegionSize, MEM_SIZE - smallRegions * smallRegionSize, RegionType::Free });
+
+    REQUIRE(allocator.Initialize(BLOCK_SIZE, regions.data(), regions.size()));
+
+    for (size_t i = 0; i < smallRegions; i++)
+    {
+        INFO(i);
+        uint8_t* ptr = basePtr + i * smallRegionSize;
+
+        if (i % 2 == 0)
+        {
+            REQUIRE(is_one_of(allocator.GetState(ptr), RegionType::Free, RegionType::Allocator));
+            REQUIRE(is_one_of(allocator.GetState(ptr + smallRegionSize - 1), RegionType::Free, RegionType::Allocator));
+        }
+        else
+        {
+            REQUIRE(allocator.GetState(ptr) == RegionType::Reserved);
+            REQUIRE(allocator.GetState(ptr + smallRegionSize - 1) == RegionType::Reserved);
+        }
+    }
+
+    REQUIRE(is_one_of(allocator.GetState(basePtr + MEM_SIZE - 1), RegionType::Free, RegionType::Allocator));
+    REQUIRE(allocator.GetState(basePtr + MEM_SIZE) == RegionType::Unmapped);
+
+    // the small free regions can still be handed out
+    std::vector<ptr_t> allocated;
+    for (ptr_t ptr = allocator.Allocate(2); ptr != nullptr; ptr = allocator.Allocate(2))
+        allocated.push_back(ptr);
+
+    REQUIRE(allocated.size() >= smallRegions / 2);
+    for (ptr_t ptr : allocated)
+        allocator.Free(ptr, 2);
+
+    delete[] basePtr;
+}
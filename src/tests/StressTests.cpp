@@ -5,11 +5,18 @@
 #include <cstdint>
 #include <random>
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 #define TEST_ITERATIONS 1000000
 #define MAX_USED_REGIONS 5000
 #define BLOCK_SIZE_1_RATIO 75
 
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_TEST_ITERATIONS 100000
+#define CONCURRENT_MAX_SIZE 200
+
 TEMPLATE_TEST_CASE("Stress test", "[stress]", ALL_ALLOCATORS)
 {
     TestType allocator;
@@ -92,6 +99,99 @@ TEMPLATE_TEST_CASE("Stress test", "[stress]", ALL_ALLOCATORS)
 
     std::cerr << "failed allocations " << failedAllocations << std::endl;
 
+    // ensure entire memory is free
+    for (uint64_t i = 0; i < MEM_SIZE; i += BLOCK_SIZE)
+        if ((i >= 0x1000 && i < 0x80000) || i >= 0x00100000)
+            REQUIRE(is_one_of(allocator.GetState(basePtr + i), RegionType::Free, RegionType::Allocator));
+
+    delete[] basePtr;
+}
+
+TEMPLATE_TEST_CASE("Concurrent stress test", "[stress][concurrent]", CONCURRENT_ALLOCATORS)
+{
+    TestType allocator;
+    uint8_t* basePtr = new uint8_t[MEM_SIZE];
+    Region regions[] = 
+    {
+        { basePtr + 0x00000000, 0x00000500, RegionType::Reserved },
+        { basePtr + 0x00000500, 0x0007FB00, RegionType::Free     },
+        { basePtr + 0x00080000, 0x00070000, RegionType::Reserved },
+        { basePtr + 0x000F0000, 0x00010000, RegionType::Reserved },
+        { basePtr + 0x00100000, MEM_SIZE - 0x00100000, RegionType::Free },
+    };
+
+    REQUIRE(allocator.Initialize(BLOCK_SIZE, regions, ArraySize(regions)));
+
+    // REQUIRE can't be used from the worker threads
+    std::atomic<int> overlaps(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < CONCURRENT_THREADS; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::vector<Region> usedRegions;
+            std::mt19937 generator(SRAND + t);
+            std::uniform_int_distribution<int> randUniform(0, 100);
+            std::geometric_distribution<size_t> randSize(0.05);
+
+            // every block of an allocation is tagged, so an overlapping allocation overwrites the tag
+            auto checkAndFree = [&](const Region& region)
+            {
+                uint64_t tag = *reinterpret_cast<uint64_t*>(region.Base);
+                for (size_t b = 0; b < region.Size; b++)
+                    if (*reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(region.Base) + b * BLOCK_SIZE) != tag)
+                        ++overlaps;
+
+                allocator.Free(region.Base, region.Size);
+            };
+
+            for (uint64_t i = 0; i < CONCURRENT_TEST_ITERATIONS; i++)
+            {
+                bool alloc = usedRegions.empty() 
+                    || (usedRegions.size() < MAX_USED_REGIONS / CONCURRENT_THREADS && randUniform(generator) < 50);
+
+                if (alloc)
+                {
+                    size_t size = 1;
+                    if (randUniform(generator) >= BLOCK_SIZE_1_RATIO)
+                    {
+                        do {
+                            size = randSize(generator);
+                        } while (size == 0 || size > CONCURRENT_MAX_SIZE);
+                    }
+
+                    ptr_t base = allocator.Allocate(size);
+                    if (base != nullptr)
+                    {
+                        uint64_t tag = (static_cast<uint64_t>(t) << 32) | i;
+                        for (size_t b = 0; b < size; b++)
+                            *reinterpret_cast<uint64_t*>(static_cast<uint8_t*>(base) + b * BLOCK_SIZE) = tag;
+
+                        usedRegions.push_back({ base, size, RegionType::Reserved });
+                    }
+                }
+                else
+                {
+                    std::uniform_int_distribution<size_t> randRegion(0, usedRegions.size() - 1);
+                    size_t reg = randRegion(generator);
+
+                    checkAndFree(usedRegions[reg]);
+                    usedRegions[reg] = usedRegions.back();
+                    usedRegions.pop_back();
+                }
+            }
+
+            for (auto& region : usedRegions)
+                checkAndFree(region);
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    REQUIRE(overlaps == 0);
+
     // ensure entire memory is free
     for (uint64_t i = 0; i < MEM_SIZE; i += BLOCK_SIZE)
         if ((i >= 0x1000 && i < 0x80000) || i >= 0x00100000)